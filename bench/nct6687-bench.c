@@ -0,0 +1,607 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * nct6687-bench - sysfs read latency and throughput benchmark for the
+ *		  nct6687 hwmon driver
+ *
+ * Works against real hardware and against the simulated chip (sim=1).
+ *
+ * Modes:
+ *  walk      N threads reading every sensor attribute, one file at a time
+ *  snapshot  N threads reading the binary snapshot attribute
+ *  compare   walk, then snapshot, with the same settings
+ *  pwm       time from a pwmN write until the EC confirmed the value
+ *
+ * Build with "make bench", run as root for the pwm mode.
+ */
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define SNAPSHOT_MAX_VOLTAGE 16
+#define SNAPSHOT_MAX_TEMP 16
+#define SNAPSHOT_MAX_FAN 16
+#define SNAPSHOT_MAX_PWM 8
+
+#define PWM_CONFIRM_TIMEOUT_MS 5000
+
+/* Mirror of struct nct6687_snapshot in nct6687.c, version 1 */
+struct nct6687_snapshot
+{
+	uint32_t version;
+	uint32_t size;
+	uint64_t generation;
+	uint64_t jiffies;
+	uint8_t num_voltage;
+	uint8_t num_temp;
+	uint8_t num_fan;
+	uint8_t num_pwm;
+	uint8_t pwm_manual;
+	uint8_t pwm_pending;
+	uint8_t reserved[2];
+	int32_t temperature[3][SNAPSHOT_MAX_TEMP];
+	int16_t voltage[3][SNAPSHOT_MAX_VOLTAGE];
+	uint16_t rpm[3][SNAPSHOT_MAX_FAN];
+	uint8_t pwm[SNAPSHOT_MAX_PWM];
+} __attribute__((packed));
+
+enum bench_mode
+{
+	MODE_WALK,
+	MODE_SNAPSHOT,
+	MODE_COMPARE,
+	MODE_PWM,
+};
+
+struct latencies
+{
+	uint64_t *ns;
+	size_t count;
+	size_t size;
+};
+
+struct bench_thread
+{
+	pthread_t thread;
+	struct latencies lat;
+	uint64_t scrapes;
+	int errors;
+};
+
+static char hwmon_dir[512];
+static char **attrs;
+static size_t num_attrs;
+static int num_threads = 4;
+static int duration = 10;
+static int pwm_channel = 1;
+static int pwm_iterations = 10;
+static int snapshot_mode;
+static volatile int running;
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void latencies_add(struct latencies *lat, uint64_t ns)
+{
+	if (lat->count == lat->size)
+	{
+		lat->size = lat->size ? lat->size * 2 : 4096;
+		lat->ns = realloc(lat->ns, lat->size * sizeof(*lat->ns));
+		if (!lat->ns)
+		{
+			perror("realloc");
+			exit(1);
+		}
+	}
+
+	lat->ns[lat->count++] = ns;
+}
+
+static int compare_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static uint64_t percentile(const struct latencies *lat, int pct)
+{
+	size_t index;
+
+	if (!lat->count)
+		return 0;
+
+	index = (lat->count - 1) * pct / 100;
+
+	return lat->ns[index];
+}
+
+static void print_latencies(const char *what, struct latencies *lat)
+{
+	qsort(lat->ns, lat->count, sizeof(*lat->ns), compare_u64);
+
+	printf("  %s latency: p50 %.1f us, p99 %.1f us, max %.1f us (%zu samples)\n",
+	       what,
+	       percentile(lat, 50) / 1000.0,
+	       percentile(lat, 99) / 1000.0,
+	       lat->count ? lat->ns[lat->count - 1] / 1000.0 : 0.0,
+	       lat->count);
+}
+
+static int read_file(const char *name, void *buf, size_t len)
+{
+	char path[1024];
+	ssize_t ret;
+	int fd;
+
+	snprintf(path, sizeof(path), "%s/%s", hwmon_dir, name);
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return -errno;
+
+	ret = read(fd, buf, len);
+	close(fd);
+
+	return ret < 0 ? -errno : (int)ret;
+}
+
+static int write_file(const char *name, const char *value)
+{
+	char path[1024];
+	ssize_t ret;
+	int fd;
+
+	snprintf(path, sizeof(path), "%s/%s", hwmon_dir, name);
+
+	fd = open(path, O_WRONLY);
+	if (fd < 0)
+		return -errno;
+
+	ret = write(fd, value, strlen(value));
+	close(fd);
+
+	return ret < 0 ? -errno : 0;
+}
+
+static long read_long(const char *name)
+{
+	char buf[64];
+	int ret;
+
+	ret = read_file(name, buf, sizeof(buf) - 1);
+	if (ret < 0)
+		return ret;
+
+	buf[ret] = '\0';
+
+	return strtol(buf, NULL, 10);
+}
+
+static int read_snapshot(struct nct6687_snapshot *snapshot)
+{
+	int ret = read_file("snapshot", snapshot, sizeof(*snapshot));
+
+	if (ret < 0)
+		return ret;
+
+	if (ret != sizeof(*snapshot) || snapshot->version != 1)
+		return -EPROTO;
+
+	return 0;
+}
+
+/* Hardware refresh counter of the driver */
+static uint64_t read_generation(void)
+{
+	struct nct6687_snapshot snapshot;
+	long seq;
+
+	if (!read_snapshot(&snapshot))
+		return snapshot.generation;
+
+	seq = read_long("sample_seq");
+
+	return seq < 0 ? 0 : seq;
+}
+
+static int is_chip_name(const char *name)
+{
+	return !strcmp(name, "nct6683") || !strcmp(name, "nct6686") || !strcmp(name, "nct6687");
+}
+
+static int find_hwmon_dir(void)
+{
+	struct dirent *entry;
+	char path[1024];
+	char name[64];
+	DIR *dir;
+	int ret = -ENODEV;
+
+	dir = opendir("/sys/class/hwmon");
+	if (!dir)
+		return -errno;
+
+	while ((entry = readdir(dir)))
+	{
+		FILE *f;
+
+		if (strncmp(entry->d_name, "hwmon", 5))
+			continue;
+
+		snprintf(path, sizeof(path), "/sys/class/hwmon/%s/name", entry->d_name);
+		f = fopen(path, "r");
+		if (!f)
+			continue;
+
+		if (fscanf(f, "%63s", name) == 1 && is_chip_name(name))
+		{
+			snprintf(hwmon_dir, sizeof(hwmon_dir), "/sys/class/hwmon/%s", entry->d_name);
+			ret = 0;
+		}
+		fclose(f);
+
+		if (!ret)
+			break;
+	}
+
+	closedir(dir);
+
+	return ret;
+}
+
+/* Attributes a monitoring agent would scrape: values, limits, alarms and PWM state */
+static int is_sensor_attr(const char *name)
+{
+	static const char *const suffixes[] = {"_input", "_min", "_max", "_alarm", "_enable"};
+	size_t len = strlen(name);
+	size_t i;
+
+	for (i = 0; i < sizeof(suffixes) / sizeof(suffixes[0]); i++)
+	{
+		size_t slen = strlen(suffixes[i]);
+
+		if (len > slen && !strcmp(name + len - slen, suffixes[i]))
+			return 1;
+	}
+
+	return !strncmp(name, "pwm", 3) && len > 3 && strspn(name + 3, "0123456789") == len - 3;
+}
+
+static int list_attrs(void)
+{
+	struct dirent *entry;
+	DIR *dir;
+
+	dir = opendir(hwmon_dir);
+	if (!dir)
+		return -errno;
+
+	while ((entry = readdir(dir)))
+	{
+		if (!is_sensor_attr(entry->d_name))
+			continue;
+
+		attrs = realloc(attrs, (num_attrs + 1) * sizeof(*attrs));
+		if (!attrs)
+			return -ENOMEM;
+
+		attrs[num_attrs++] = strdup(entry->d_name);
+	}
+
+	closedir(dir);
+
+	return num_attrs ? 0 : -ENOENT;
+}
+
+static void *bench_thread_fn(void *arg)
+{
+	struct bench_thread *t = arg;
+	struct nct6687_snapshot snapshot;
+	char buf[64];
+	uint64_t start;
+	size_t i;
+
+	while (__atomic_load_n(&running, __ATOMIC_RELAXED))
+	{
+		if (snapshot_mode)
+		{
+			start = now_ns();
+			if (read_snapshot(&snapshot))
+				t->errors++;
+			latencies_add(&t->lat, now_ns() - start);
+		}
+		else
+		{
+			for (i = 0; i < num_attrs; i++)
+			{
+				start = now_ns();
+				if (read_file(attrs[i], buf, sizeof(buf)) < 0)
+					t->errors++;
+				latencies_add(&t->lat, now_ns() - start);
+			}
+		}
+
+		t->scrapes++;
+	}
+
+	return NULL;
+}
+
+static int run_read_bench(int use_snapshot)
+{
+	struct bench_thread *threads;
+	struct latencies all = {0};
+	uint64_t scrapes = 0, generation, start;
+	double elapsed;
+	int errors = 0;
+	int i;
+
+	snapshot_mode = use_snapshot;
+
+	threads = calloc(num_threads, sizeof(*threads));
+	if (!threads)
+		return -ENOMEM;
+
+	generation = read_generation();
+	start = now_ns();
+	running = 1;
+
+	for (i = 0; i < num_threads; i++)
+	{
+		if (pthread_create(&threads[i].thread, NULL, bench_thread_fn, &threads[i]))
+		{
+			perror("pthread_create");
+			exit(1);
+		}
+	}
+
+	sleep(duration);
+	__atomic_store_n(&running, 0, __ATOMIC_RELAXED);
+
+	for (i = 0; i < num_threads; i++)
+	{
+		struct bench_thread *t = &threads[i];
+		size_t j;
+
+		pthread_join(t->thread, NULL);
+
+		for (j = 0; j < t->lat.count; j++)
+			latencies_add(&all, t->lat.ns[j]);
+
+		scrapes += t->scrapes;
+		errors += t->errors;
+		free(t->lat.ns);
+	}
+
+	elapsed = (now_ns() - start) / 1e9;
+	generation = read_generation() - generation;
+
+	printf("%s: %d threads, %.1f s, %s\n",
+	       use_snapshot ? "snapshot" : "walk", num_threads, elapsed,
+	       use_snapshot ? "1 read per scrape" : "one read per attribute");
+	if (!use_snapshot)
+		printf("  attributes per scrape: %zu\n", num_attrs);
+	print_latencies("read()", &all);
+	printf("  scrapes/s: %.1f, reads/s: %.1f, EC refreshes/s: %.1f\n",
+	       scrapes / elapsed, all.count / elapsed, generation / elapsed);
+	if (errors)
+		printf("  errors: %d\n", errors);
+
+	free(all.ns);
+	free(threads);
+
+	return 0;
+}
+
+static int run_pwm_bench(void)
+{
+	struct latencies write_lat = {0}, confirm_lat = {0};
+	struct nct6687_snapshot snapshot;
+	char pwm_name[32], enable_name[32], value[16];
+	long orig_pwm, orig_enable;
+	int bit = pwm_channel - 1;
+	int timeouts = 0;
+	int i, ret;
+
+	if (pwm_channel < 1 || pwm_channel > SNAPSHOT_MAX_PWM)
+	{
+		fprintf(stderr, "invalid pwm channel %d\n", pwm_channel);
+		return -EINVAL;
+	}
+
+	if (read_snapshot(&snapshot))
+	{
+		fprintf(stderr, "pwm mode needs the snapshot attribute\n");
+		return -ENOENT;
+	}
+
+	snprintf(pwm_name, sizeof(pwm_name), "pwm%d", pwm_channel);
+	snprintf(enable_name, sizeof(enable_name), "pwm%d_enable", pwm_channel);
+
+	orig_pwm = read_long(pwm_name);
+	orig_enable = read_long(enable_name);
+	if (orig_pwm < 0 || orig_enable < 0)
+	{
+		fprintf(stderr, "cannot read %s\n", pwm_name);
+		return -ENOENT;
+	}
+
+	for (i = 0; i < pwm_iterations; i++)
+	{
+		int target = (i & 1) ? 160 : 96;
+		uint64_t start, written;
+
+		snprintf(value, sizeof(value), "%d", target);
+
+		start = now_ns();
+		ret = write_file(pwm_name, value);
+		written = now_ns();
+		if (ret)
+		{
+			fprintf(stderr, "write %s: %s\n", pwm_name, strerror(-ret));
+			break;
+		}
+		latencies_add(&write_lat, written - start);
+
+		for (;;)
+		{
+			if (!read_snapshot(&snapshot) && !(snapshot.pwm_pending & (1 << bit)) && snapshot.pwm[bit] == target)
+			{
+				latencies_add(&confirm_lat, now_ns() - start);
+				break;
+			}
+
+			if (now_ns() - start > PWM_CONFIRM_TIMEOUT_MS * 1000000ULL)
+			{
+				timeouts++;
+				break;
+			}
+
+			usleep(1000);
+		}
+	}
+
+	/* Put the channel back the way it was */
+	snprintf(value, sizeof(value), "%ld", orig_pwm);
+	write_file(pwm_name, value);
+	if (orig_enable != 1)
+	{
+		snprintf(value, sizeof(value), "%ld", orig_enable);
+		write_file(enable_name, value);
+	}
+
+	printf("pwm: %s, %d writes\n", pwm_name, pwm_iterations);
+	print_latencies("write()", &write_lat);
+	print_latencies("write-to-confirm", &confirm_lat);
+	if (timeouts)
+		printf("  unconfirmed after %d ms: %d\n", PWM_CONFIRM_TIMEOUT_MS, timeouts);
+
+	free(write_lat.ns);
+	free(confirm_lat.ns);
+
+	return 0;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"Usage: %s [-d hwmon_dir] [-m walk|snapshot|compare|pwm] [-t threads] [-s seconds] [-p pwm] [-n writes]\n"
+		"  -d  hwmon directory of the driver (default: first nct6687 device)\n"
+		"  -m  benchmark mode (default: walk)\n"
+		"  -t  reader threads (default: 4)\n"
+		"  -s  duration of each read benchmark in seconds (default: 10)\n"
+		"  -p  pwm channel for the pwm mode (default: 1)\n"
+		"  -n  number of pwm writes (default: 10)\n",
+		prog);
+}
+
+int main(int argc, char **argv)
+{
+	enum bench_mode mode = MODE_WALK;
+	int opt, ret;
+
+	while ((opt = getopt(argc, argv, "d:m:t:s:p:n:h")) != -1)
+	{
+		switch (opt)
+		{
+		case 'd':
+			snprintf(hwmon_dir, sizeof(hwmon_dir), "%s", optarg);
+			break;
+		case 'm':
+			if (!strcmp(optarg, "walk"))
+				mode = MODE_WALK;
+			else if (!strcmp(optarg, "snapshot"))
+				mode = MODE_SNAPSHOT;
+			else if (!strcmp(optarg, "compare"))
+				mode = MODE_COMPARE;
+			else if (!strcmp(optarg, "pwm"))
+				mode = MODE_PWM;
+			else
+			{
+				usage(argv[0]);
+				return 1;
+			}
+			break;
+		case 't':
+			num_threads = atoi(optarg);
+			break;
+		case 's':
+			duration = atoi(optarg);
+			break;
+		case 'p':
+			pwm_channel = atoi(optarg);
+			break;
+		case 'n':
+			pwm_iterations = atoi(optarg);
+			break;
+		default:
+			usage(argv[0]);
+			return opt == 'h' ? 0 : 1;
+		}
+	}
+
+	if (num_threads < 1 || duration < 1 || pwm_iterations < 1)
+	{
+		usage(argv[0]);
+		return 1;
+	}
+
+	if (!hwmon_dir[0] && find_hwmon_dir())
+	{
+		fprintf(stderr, "no nct6687 hwmon device found, load the driver (sim=1 without hardware) or use -d\n");
+		return 1;
+	}
+
+	printf("device: %s\n", hwmon_dir);
+
+	if (mode == MODE_SNAPSHOT || mode == MODE_COMPARE)
+	{
+		struct nct6687_snapshot snapshot;
+
+		if (read_snapshot(&snapshot))
+		{
+			fprintf(stderr, "no usable snapshot attribute in %s\n", hwmon_dir);
+			return 1;
+		}
+	}
+
+	switch (mode)
+	{
+	case MODE_WALK:
+	case MODE_COMPARE:
+		ret = list_attrs();
+		if (ret)
+		{
+			fprintf(stderr, "no sensor attributes in %s\n", hwmon_dir);
+			return 1;
+		}
+
+		ret = run_read_bench(0);
+		if (!ret && mode == MODE_COMPARE)
+			ret = run_read_bench(1);
+		break;
+	case MODE_SNAPSHOT:
+		ret = run_read_bench(1);
+		break;
+	default:
+		ret = run_pwm_bench();
+		break;
+	}
+
+	return ret ? 1 : 0;
+}
@@ -25,17 +25,31 @@
 #define pr_fmt(fmt) KBUILD_MODNAME ": " fmt
 
 #include <linux/acpi.h>
+#include <linux/bitops.h>
+#include <linux/debugfs.h>
 #include <linux/delay.h>
 #include <linux/err.h>
 #include <linux/init.h>
 #include <linux/io.h>
 #include <linux/jiffies.h>
+#include <linux/ktime.h>
 #include <linux/hwmon.h>
 #include <linux/hwmon-sysfs.h>
 #include <linux/module.h>
 #include <linux/mutex.h>
 #include <linux/platform_device.h>
+#include <linux/regmap.h>
+#include <linux/seq_file.h>
+#include <linux/seqlock.h>
 #include <linux/slab.h>
+#include <linux/string.h>
+#include <linux/spinlock.h>
+#include <linux/thermal.h>
+#include <linux/version.h>
+#include <linux/workqueue.h>
+
+#define CREATE_TRACE_POINTS
+#include "nct6687_trace.h"
 
 #ifndef MIN
 #define MIN(a,b) (((a)<(b))?(a):(b))
@@ -52,15 +66,61 @@ enum kinds
 	nct6687
 };
 
+/* Sensor classes refreshed independently of each other */
+enum nct6687_sensor_class
+{
+	NCT6687_CLASS_VOLTAGE,
+	NCT6687_CLASS_TEMP,
+	NCT6687_CLASS_FAN,
+	NCT6687_CLASS_PWM,
+	NCT6687_NUM_CLASS
+};
+
+#define NCT6687_UPDATE_VOLTAGE BIT(NCT6687_CLASS_VOLTAGE)
+#define NCT6687_UPDATE_TEMP BIT(NCT6687_CLASS_TEMP)
+#define NCT6687_UPDATE_FAN BIT(NCT6687_CLASS_FAN)
+#define NCT6687_UPDATE_PWM BIT(NCT6687_CLASS_PWM)
+#define NCT6687_UPDATE_ALL (BIT(NCT6687_NUM_CLASS) - 1)
+
+/* Classes whose refresh also reads the EC alarm status with hw_limits */
+#define NCT6687_UPDATE_ALARMS (NCT6687_UPDATE_VOLTAGE | NCT6687_UPDATE_TEMP | NCT6687_UPDATE_FAN)
+
+/* Classes with a sample history: voltages, temperatures and fans */
+#define NCT6687_NUM_HISTORY NCT6687_CLASS_PWM
+
 enum pwm_enable
 {
 	manual_mode = 1,
-	// There are multiple automatic modes, none of which is configurable by this module yet.
+	// Temperature curve evaluated by this driver, see nct6687_update_curves()
+	curve_mode = 2,
+	// There are multiple automatic modes, none of which is configurable by this module yet:
+	// the layout of the firmware curve tables is not documented and differs between
+	// board vendors, so curves are only programmable through curve_mode.
 	firmware_mode = 99,
 };
 
 static bool force;
 static bool manual;
+static int io_delay = -1;
+static bool coherent;
+static bool sampler;
+static bool hw_limits;
+static int notify_in = 50;
+static int notify_temp = 1000;
+static int notify_fan = 100;
+static bool adaptive;
+static int adaptive_floor = 250;
+static int adaptive_temp = 1000;
+static int adaptive_fan = 300;
+static int history_depth;
+static unsigned int fan_mask = ~0U;
+static unsigned int in_mask = ~0U;
+static unsigned int temp_mask = ~0U;
+static bool fan_autodetect;
+static bool cooling_device;
+static bool sim;
+static int sim_latency = 1000;
+static int sim_period = 60000;
 
 module_param(force, bool, 0);
 MODULE_PARM_DESC(force, "Set to one to enable support for unknown vendors");
@@ -68,6 +128,66 @@ MODULE_PARM_DESC(force, "Set to one to enable support for unknown vendors");
 module_param(manual, bool, 0);
 MODULE_PARM_DESC(manual, "Set voltage input and voltage label configured with external sensors file");
 
+module_param(coherent, bool, 0);
+MODULE_PARM_DESC(coherent, "Set to one to refresh all sensors together instead of only the class being read");
+
+module_param(sampler, bool, 0);
+MODULE_PARM_DESC(sampler, "Set to one to sample sensors in the background at update_interval, reads never access the EC");
+
+module_param(hw_limits, bool, 0);
+MODULE_PARM_DESC(hw_limits, "Set to one to expose the EC limit registers as *_min/*_max and their *_alarm status instead of the lowest/highest values seen");
+
+module_param(notify_in, int, 0644);
+MODULE_PARM_DESC(notify_in, "Sampler mode: notify inN_input pollers on changes of at least this many mV, 0 to disable");
+
+module_param(notify_temp, int, 0644);
+MODULE_PARM_DESC(notify_temp, "Sampler mode: notify tempN_input pollers on changes of at least this many millidegrees, 0 to disable");
+
+module_param(notify_fan, int, 0644);
+MODULE_PARM_DESC(notify_fan, "Sampler mode: notify fanN_input pollers on changes of at least this many RPM, 0 to disable");
+
+module_param(adaptive, bool, 0);
+MODULE_PARM_DESC(adaptive, "Sampler mode: sample faster while temperatures or fan speeds move, and back off to update_interval while they are stable");
+
+module_param(adaptive_floor, int, 0644);
+MODULE_PARM_DESC(adaptive_floor, "Adaptive sampling: shortest sampling period in milliseconds (default 250)");
+
+module_param(adaptive_temp, int, 0644);
+MODULE_PARM_DESC(adaptive_temp, "Adaptive sampling: temperature rate of change in millidegrees per second that selects the shortest period (default 1000)");
+
+module_param(adaptive_fan, int, 0644);
+MODULE_PARM_DESC(adaptive_fan, "Adaptive sampling: fan speed change in RPM within a window that selects the shortest period (default 300)");
+
+module_param(history_depth, int, 0);
+MODULE_PARM_DESC(history_depth, "Number of recent samples kept per channel for the *_average, *_lowest and *_highest attributes, 0 to disable (default 0)");
+
+module_param(io_delay, int, 0);
+MODULE_PARM_DESC(io_delay, "EC port access delay: -1 = paused port I/O (default), 0 = no delay, 1-100 = delay in microseconds");
+
+module_param(fan_mask, uint, 0);
+MODULE_PARM_DESC(fan_mask, "Bitmask of the fan inputs to monitor, bit 0 for fan1 (default all)");
+
+module_param(in_mask, uint, 0);
+MODULE_PARM_DESC(in_mask, "Bitmask of the voltage inputs to monitor, bit 0 for in0 (default all)");
+
+module_param(temp_mask, uint, 0);
+MODULE_PARM_DESC(temp_mask, "Bitmask of the temperatures to monitor, bit 0 for temp1 (default all)");
+
+module_param(fan_autodetect, bool, 0);
+MODULE_PARM_DESC(fan_autodetect, "Set to one to hide fans reading 0 RPM at load time while under firmware control");
+
+module_param(cooling_device, bool, 0);
+MODULE_PARM_DESC(cooling_device, "Set to one to register each PWM channel as a thermal cooling device, states 0-255 being the duty cycle");
+
+module_param(sim, bool, 0);
+MODULE_PARM_DESC(sim, "Set to one to register a simulated nct6687 instead of probing the Super-I/O ports, for benchmarking without hardware");
+
+module_param(sim_latency, int, 0644);
+MODULE_PARM_DESC(sim_latency, "Simulated chip: delay of each EC register access in nanoseconds (default 1000)");
+
+module_param(sim_period, int, 0644);
+MODULE_PARM_DESC(sim_period, "Simulated chip: period of the temperature waveform in milliseconds (default 60000)");
+
 static const char *const nct6687_device_names[] = {
 	"nct6683",
 	"nct6686",
@@ -103,6 +223,10 @@ static const char *const nct6687_chip_names[] = {
 #define SIO_NCT6687_ID          0xd590
 #define SIO_ID_MASK             0xFFF0
 
+/* EC base address verification, backing off from 10 us only while reads disagree */
+#define SIO_ADDR_VERIFY_TRIES 6
+#define SIO_ADDR_VERIFY_DELAY_US 10
+
 static inline void superio_outb(int ioreg, int reg, int val)
 {
 	outb(reg, ioreg);
@@ -136,6 +260,11 @@ static inline int superio_enter(int ioreg)
 	return 0;
 }
 
+static inline u16 superio_inw(int ioreg, int reg)
+{
+	return (superio_inb(ioreg, reg) << 8) | superio_inb(ioreg, reg + 1);
+}
+
 static inline void superio_exit(int ioreg)
 {
 	outb(0xaa, ioreg);
@@ -154,10 +283,14 @@ static inline void superio_exit(int ioreg)
 
 /* Common and NCT6687 specific data */
 
-#define NCT6687_NUM_REG_VOLTAGE (sizeof(nct6687_voltage_definition) / sizeof(struct voltage_reg))
-#define NCT6687_NUM_REG_TEMP 7
-#define NCT6687_NUM_REG_FAN 8
-#define NCT6687_NUM_REG_PWM 8
+/*
+ * Most channels the sensor window can address, per class. The channels of
+ * the detected chip are described by struct nct6687_chip_info.
+ */
+#define NCT6687_MAX_VOLTAGE 16
+#define NCT6687_MAX_TEMP 16
+#define NCT6687_MAX_FAN 16
+#define NCT6687_NUM_REG_PWM 8 /* one FAN_CTRL_MODE bit per channel */
 
 #define NCT6687_REG_TEMP(x) (0x100 + (x)*2)
 #define NCT6687_REG_VOLTAGE(x) (0x120 + (x)*2)
@@ -165,6 +298,17 @@ static inline void superio_exit(int ioreg)
 #define NCT6687_REG_PWM(x) (0x160 + (x))
 #define NCT6687_REG_PWM_WRITE(x) (0xa28 + (x))
 
+/* Live sensor registers, fetched in bursts into nct6687_data.window */
+#define NCT6687_SENSOR_WINDOW_BASE 0x100
+#define NCT6687_SENSOR_WINDOW_SIZE 0x80
+
+/* Alarm status, laid out as NCT6683: one bit per monitoring channel / fan */
+#define NCT6687_REG_MON_STS(x) (0x174 + (x))
+#define NCT6687_REG_FAN_STS(x) (0x17c + (x))
+
+/* Monitoring channel of the first voltage, temperatures use channels 0-15 */
+#define NCT6687_MON_VOLTAGE_BASE 16
+
 #define NCT6687_HWM_CFG 0x180
 
 #define NCT6687_REG_MON_CFG(x) (0x1a0 + (x))
@@ -184,6 +328,9 @@ static inline void superio_exit(int ioreg)
 //#define NCT6687_FAN_CFG_DONE          0x40    //! for 6683 returns auto mode and clears 0xA00, 0xA28-0xA2F registers
 #define NCT6687_FAN_CFG_DONE            0x00    //! tested on 6683 6687
 
+/* PWM read backs after a handshake, 50 ms apart */
+#define NCT6687_PWM_READBACK_TRIES 20
+
 #define NCT6687_REG_BUILD_YEAR 0x604
 #define NCT6687_REG_BUILD_MONTH 0x605
 #define NCT6687_REG_BUILD_DAY 0x606
@@ -202,6 +349,24 @@ static inline void superio_exit(int ioreg)
 #define EC_SPACE_DATA_REGISTER_OFFSET 0x06
 #define EC_SPACE_PAGE_SELECT 0xFF
 
+#define NCT6687_IO_DELAY_PAUSED -1
+#define NCT6687_IO_DELAY_MAX 100
+#define NCT6687_IO_CHECK_LOOPS 8
+
+/* Sensor cache lifetime in milliseconds, see update_interval attribute */
+#define NCT6687_UPDATE_INTERVAL_DEFAULT 1000
+#define NCT6687_UPDATE_INTERVAL_MIN 100
+#define NCT6687_UPDATE_INTERVAL_MAX 60000
+
+/* Adaptive sampling: shortest window rates are measured over, in milliseconds */
+#define NCT6687_ADAPTIVE_WINDOW 1000
+/* Temperature resolution, changes this small are quantization flicker */
+#define NCT6687_TEMP_LSB 500
+
+/* Sample history, see history_depth parameter */
+#define NCT6687_HISTORY_CHANNELS 16
+#define NCT6687_HISTORY_DEPTH_MAX 1024
+
 struct voltage_reg
 {
 	u16 reg;
@@ -209,7 +374,7 @@ struct voltage_reg
 	const char *label;
 };
 
-static struct voltage_reg nct6687_voltage_definition[] = {
+static const struct voltage_reg nct6687_voltage_definition[] = {
 	// +12V
 	{
 		.reg = 0,
@@ -318,620 +483,2566 @@ static const char *const nct6687_fan_label[] = {
 	"System Fan #4",
 	"System Fan #5",
 	"System Fan #6",
+	"System Fan #7",
+	"System Fan #8",
+	"System Fan #9",
+	"System Fan #10",
+	"System Fan #11",
+	"System Fan #12",
+	"System Fan #13",
+	"System Fan #14",
 	NULL,
 };
 
-/* ------------------------------------------------------- */
-struct nct6687_data
-{
-	int addr;	/* IO base of EC space */
-	int sioreg; /* SIO register */
-	enum kinds kind;
+/* NCT6686D: the NCT6687 voltages plus the two inputs left in the sensor window */
+static const struct voltage_reg nct6686_voltage_definition[] = {
+	{ .reg = 0, .multiplier = 12, .label = "+12V" },
+	{ .reg = 1, .multiplier = 5, .label = "+5V" },
+	{ .reg = 11, .multiplier = 1, .label = "+3.3V" },
+	{ .reg = 2, .multiplier = 1, .label = "CPU Soc" },
+	{ .reg = 4, .multiplier = 1, .label = "CPU Vcore" },
+	{ .reg = 9, .multiplier = 1, .label = "CPU 1P8" },
+	{ .reg = 10, .multiplier = 1, .label = "CPU VDDP" },
+	{ .reg = 3, .multiplier = 2, .label = "DRAM" },
+	{ .reg = 5, .multiplier = 1, .label = "Chipset" },
+	{ .reg = 6, .multiplier = 1, .label = "CPU SA" },
+	{ .reg = 7, .multiplier = 1, .label = "Voltage #2" },
+	{ .reg = 8, .multiplier = 1, .label = "AVCC3" },
+	{ .reg = 12, .multiplier = 1, .label = "AVSB" },
+	{ .reg = 13, .multiplier = 1, .label = "VBat" },
+	{ .reg = 14, .multiplier = 1, .label = "Voltage #3" },
+	{ .reg = 15, .multiplier = 1, .label = "Voltage #4" },
+};
 
-	struct device *hwmon_dev;
-	const struct attribute_group *groups[6];
+static const char *const nct6686_temp_label[] = {
+	"CPU",
+	"System",
+	"VRM MOS",
+	"PCH",
+	"CPU Socket",
+	"PCIe x1",
+	"M2_1",
+	"Temperature #8",
+	"Temperature #9",
+	"Temperature #10",
+	"Temperature #11",
+	"Temperature #12",
+	"Temperature #13",
+	"Temperature #14",
+	"Temperature #15",
+	"Temperature #16",
+	NULL,
+};
 
-	struct mutex update_lock;	/* used to protect sensor updates */
-	struct mutex EC_io_lock;	/* used to protect EC io */
-	bool valid;					/* true if following fields are valid */
-	unsigned long last_updated; /* In jiffies */
+/* Channels of each supported chip, indexed by enum kinds */
+struct nct6687_chip_info
+{
+	int num_voltage;
+	int num_temp;
+	int num_fan;
+	const struct voltage_reg *voltage;
+	const char *const *temp_label;
+	const char *const *fan_label;
+};
+
+static const struct nct6687_chip_info nct6687_chip_info[] = {
+	[nct6683] = {
+		.num_voltage = ARRAY_SIZE(nct6687_voltage_definition),
+		.num_temp = 7,
+		.num_fan = 8,
+		.voltage = nct6687_voltage_definition,
+		.temp_label = nct6687_temp_label,
+		.fan_label = nct6687_fan_label,
+	},
+	/* The sensor window holds 16 temperatures, voltages and fans at most */
+	[nct6686] = {
+		.num_voltage = ARRAY_SIZE(nct6686_voltage_definition),
+		.num_temp = 16,
+		.num_fan = 16,
+		.voltage = nct6686_voltage_definition,
+		.temp_label = nct6686_temp_label,
+		.fan_label = nct6687_fan_label,
+	},
+	[nct6687] = {
+		.num_voltage = ARRAY_SIZE(nct6687_voltage_definition),
+		.num_temp = 7,
+		.num_fan = 8,
+		.voltage = nct6687_voltage_definition,
+		.temp_label = nct6687_temp_label,
+		.fan_label = nct6687_fan_label,
+	},
+};
 
+/* ------------------------------------------------------- */
+struct nct6687_sensors
+{
 	/* Voltage values */
-	s16 voltage[3][NCT6687_NUM_REG_VOLTAGE]; // 0 = current 1 = min 2 = max
+	s16 voltage[3][NCT6687_MAX_VOLTAGE]; // 0 = current 1 = min 2 = max
 
 	/* Temperature values */
-	s32 temperature[3][NCT6687_NUM_REG_TEMP]; // 0 = current 1 = min 2 = max
+	s32 temperature[3][NCT6687_MAX_TEMP]; // 0 = current 1 = min 2 = max
 
 	/* Fan attribute values */
-	u16 rpm[3][NCT6687_NUM_REG_FAN]; // 0 = current 1 = min 2 = max
-	u8 _initialFanControlMode[NCT6687_NUM_REG_FAN];
-	u8 _initialFanPwmCommand[NCT6687_NUM_REG_FAN];
-	bool _restoreDefaultFanControlRequired[NCT6687_NUM_REG_FAN];
+	u16 rpm[3][NCT6687_MAX_FAN]; // 0 = current 1 = min 2 = max
 
 	u8 pwm[NCT6687_NUM_REG_PWM];
 	enum pwm_enable pwm_enable[NCT6687_NUM_REG_PWM];
 
-	/* Remember extra register values over suspend/resume */
-	u8 hwm_cfg;
+	/* Alarm status, only read with the hw_limits parameter set */
+	u32 mon_alarms;				/* bit set per monitoring channel in alarm */
+	u16 fan_alarms;				/* bit set per fan in alarm */
+
+	u64 generation;				/* incremented on each hardware refresh */
+	unsigned long updated;		/* In jiffies */
+	u64 updated_ns;				/* CLOCK_MONOTONIC, in nanoseconds */
 };
 
-struct nct6687_sio_data
+#define NCT6687_CURVE_POINTS 5
+
+/* Temperature to PWM curve of one channel in curve_mode, see nct6687_update_curves() */
+struct nct6687_fan_curve
 {
-	int sioreg;
-	enum kinds kind;
+	u16 temp_channels;			/* bit set per source temperature, the hottest is used */
+	s32 temp[NCT6687_CURVE_POINTS]; /* In millidegrees, ascending */
+	u8 pwm[NCT6687_CURVE_POINTS];
+	s32 hyst;					/* In millidegrees */
+	unsigned int ramp_rate;		/* Max PWM change per second, 0 for no limit */
+
+	/* Evaluation state */
+	bool output_valid;
+	u8 output;					/* last PWM value queued */
+	s32 output_temp;			/* source temperature when output was queued */
+	unsigned long output_time;	/* In jiffies */
 };
 
-struct sensor_device_template
+/*
+ * Layout of the binary snapshot attribute, in host byte order. Arrays are
+ * sized for the largest number of channels the EC sensor window can hold;
+ * the num_* fields tell how many entries are in use. Any layout change must
+ * bump NCT6687_SNAPSHOT_VERSION.
+ */
+#define NCT6687_SNAPSHOT_VERSION 1
+#define NCT6687_SNAPSHOT_MAX_VOLTAGE 16
+#define NCT6687_SNAPSHOT_MAX_TEMP 16
+#define NCT6687_SNAPSHOT_MAX_FAN 16
+#define NCT6687_SNAPSHOT_MAX_PWM 8
+
+struct nct6687_snapshot
 {
-	struct device_attribute dev_attr;
-	union
-	{
-		struct
-		{
-			u8 nr;
-			u8 index;
-		} s;
-		int index;
-	} u;
-	bool s2; /* true if both index and nr are used */
+	u32 version;
+	u32 size;					/* sizeof(struct nct6687_snapshot) */
+	u64 generation;				/* incremented on each hardware refresh */
+	u64 jiffies;				/* time of the last refresh */
+	u8 num_voltage;
+	u8 num_temp;
+	u8 num_fan;
+	u8 num_pwm;
+	u8 pwm_manual;				/* bit set if the channel is in manual mode */
+	u8 pwm_pending;				/* bit set if a PWM write is not confirmed yet */
+	u8 reserved[2];
+	s32 temperature[3][NCT6687_SNAPSHOT_MAX_TEMP]; // 0 = current 1 = min 2 = max
+	s16 voltage[3][NCT6687_SNAPSHOT_MAX_VOLTAGE]; // 0 = current 1 = min 2 = max
+	u16 rpm[3][NCT6687_SNAPSHOT_MAX_FAN]; // 0 = current 1 = min 2 = max
+	u8 pwm[NCT6687_SNAPSHOT_MAX_PWM];
+} __packed;
+
+struct nct6687_data;
+
+/*
+ * EC register access backend, see nct6687_port_ops and nct6687_sim_ops.
+ * Both callbacks are called with EC_io_lock held.
+ */
+struct nct6687_ec_ops
+{
+	const char *name;
+	u8 (*read)(struct nct6687_data *data, u16 address);
+	void (*write)(struct nct6687_data *data, u16 address, u8 value);
 };
 
-struct sensor_device_attr_u
+/* Memory backed register file of the simulated chip */
+struct nct6687_sim
 {
-	union
-	{
-		struct sensor_device_attribute a1;
-		struct sensor_device_attribute_2 a2;
-	} u;
-	char name[32];
+	u8 regs[0x10000];
+	unsigned long start; /* In jiffies, origin of the waveforms */
 };
 
-#define __TEMPLATE_ATTR(_template, _mode, _show, _store) \
-	{                                                    \
-		.attr = {.name = _template, .mode = _mode},      \
-		.show = _show,                                   \
-		.store = _store,                                 \
-	}
+/* Update latency histogram, bucket n counts calls of [2^(n-1), 2^n) microseconds */
+#define NCT6687_LATENCY_BUCKETS 16
 
-#define SENSOR_DEVICE_TEMPLATE(_template, _mode, _show, _store, _index) \
-	{                                                                   \
-		.dev_attr = __TEMPLATE_ATTR(_template, _mode, _show, _store),   \
-		.u.index = _index,                                              \
-		.s2 = false                                                     \
-	}
+/* EC access counters, reported in debugfs by nct6687_stats_show() */
+struct nct6687_stats
+{
+	atomic64_t ec_reads;		/* EC bytes read */
+	atomic64_t ec_writes;		/* EC bytes written */
+	atomic64_t page_switches;
+	atomic64_t refreshes;		/* nct6687_refresh() calls */
+	atomic64_t cache_hits;		/* nct6687_update_device() calls served from the cache */
+	atomic64_t refresh_ns;		/* cumulative nct6687_refresh() duration */
+	u64 refresh_max_ns;			/* protected by update_lock */
+	atomic64_t lock_waits;		/* update_lock acquisitions by readers */
+	atomic64_t lock_wait_ns;	/* cumulative time readers waited for update_lock */
+	atomic64_t pwm_commits;		/* PWM handshakes */
+	atomic64_t pwm_retries;		/* PWM readback polls after the first one */
+	atomic64_t latency[NCT6687_LATENCY_BUCKETS];
+};
 
-#define SENSOR_DEVICE_TEMPLATE_2(_template, _mode, _show, _store,     \
-								 _nr, _index)                         \
-	{                                                                 \
-		.dev_attr = __TEMPLATE_ATTR(_template, _mode, _show, _store), \
-		.u.s.index = _index,                                          \
-		.u.s.nr = _nr,                                                \
-		.s2 = true                                                    \
-	}
+/*
+ * Ring of the last samples of a sensor class, one row of
+ * NCT6687_HISTORY_CHANNELS values per refresh. Protected by update_lock.
+ */
+struct nct6687_history
+{
+	s32 *samples;		/* history_depth rows, allocated at probe */
+	unsigned int head;	/* row written by the next refresh */
+	unsigned int count[NCT6687_HISTORY_CHANNELS]; /* rows recorded since the last reset */
+};
+
+/* Thermal cooling device of a PWM channel */
+struct nct6687_cooling
+{
+	struct nct6687_data *data;
+	struct thermal_cooling_device *tcdev;
+	int channel;
+	char type[THERMAL_NAME_LENGTH];
+};
+
+struct nct6687_data
+{
+	int addr;	/* IO base of EC space */
+	int sioreg; /* SIO register */
+	enum kinds kind;
+	const struct nct6687_chip_info *chip;
 
-#define SENSOR_TEMPLATE(_name, _template, _mode, _show, _store, _index)                                                        \
-	static struct sensor_device_template sensor_dev_template_##_name = SENSOR_DEVICE_TEMPLATE(_template, _mode, _show, _store, \
-																							  _index)
+	const struct nct6687_ec_ops *ec_ops;
+	struct nct6687_sim *sim;	/* register file of nct6687_sim_ops */
+	struct regmap *regmap;		/* EC space on top of ec_ops, locked by EC_io_lock */
 
-#define SENSOR_TEMPLATE_2(_name, _template, _mode, _show, _store,                                                                \
-						  _nr, _index)                                                                                           \
-	static struct sensor_device_template sensor_dev_template_##_name = SENSOR_DEVICE_TEMPLATE_2(_template, _mode, _show, _store, \
-																								_nr, _index)
+	struct device *hwmon_dev;
+
+	struct mutex update_lock;	/* used to protect sensor updates */
+	struct mutex EC_io_lock;	/* used to protect EC io */
+	int io_delay;				/* EC port access delay, see io_delay parameter */
+	int ec_page;				/* EC page currently selected, or -1 if unknown */
+	bool valid[NCT6687_NUM_CLASS];	/* true if the class values are valid */
+	unsigned long last_updated[NCT6687_NUM_CLASS]; /* In jiffies */
+	unsigned int sampled;		/* NCT6687_UPDATE_* classes read at least once */
+	unsigned int update_interval; /* In milliseconds */
+	unsigned int history_depth;	/* rows of each history ring, 0 if disabled */
+	struct nct6687_history history[NCT6687_NUM_HISTORY];
+
+	/* Raw copy of the EC sensor window, refreshed by nct6687_read_block() */
+	u8 window[NCT6687_SENSOR_WINDOW_SIZE];
+
+	/* Sensor values being refreshed, only accessed with update_lock held */
+	struct nct6687_sensors shadow;
+
+	/* Sensor values published to readers, protected by sample_lock */
+	struct nct6687_sensors sensors;
+	seqlock_t sample_lock;
+	struct delayed_work sample_work;
+
+	/* Values last reported to pollers, only used by nct6687_sample_work() */
+	bool notified_valid;
+	s16 notified_voltage[NCT6687_MAX_VOLTAGE];
+	s32 notified_temperature[NCT6687_MAX_TEMP];
+	u16 notified_rpm[NCT6687_MAX_FAN];
+
+	/* Adaptive sampling state, only used by nct6687_sample_work() */
+	unsigned int sample_interval;	/* current sampling period in milliseconds */
+	bool activity_valid;
+	bool activity_seen;			/* the previous window was active */
+	u64 activity_ns;			/* updated_ns of the reference sample */
+	s32 activity_temperature[NCT6687_MAX_TEMP];
+	u16 activity_rpm[NCT6687_MAX_FAN];
+
+	/* PWM writes queued for nct6687_pwm_work() */
+	struct mutex pwm_lock;		/* used to protect fan control updates */
+	spinlock_t pwm_pending_lock; /* used to protect pwm_pending and pwm_target */
+	unsigned long pwm_pending;
+	u8 pwm_target[NCT6687_NUM_REG_PWM];
+	struct work_struct pwm_work;
+
+	u8 fan_ctrl_mode;			/* cached FAN_CTRL_MODE, one manual mode bit per channel */
+
+	/* Channels monitored and shown, set at probe from the *_mask parameters */
+	unsigned long have_fan;
+	unsigned long have_in;
+	unsigned long have_temp;
+
+	/* In-driver fan curves, protected by update_lock */
+	unsigned long curve_enabled; /* bit set per channel in curve_mode */
+	struct nct6687_fan_curve curve[NCT6687_NUM_REG_PWM];
+
+	u8 _initialFanControlMode[NCT6687_NUM_REG_PWM];
+	u8 _initialFanPwmCommand[NCT6687_NUM_REG_PWM];
+	bool _restoreDefaultFanControlRequired[NCT6687_NUM_REG_PWM];
+
+	/* EC limit registers, protected by update_lock and only used with hw_limits */
+	u8 in_low[NCT6687_MAX_VOLTAGE];
+	u8 in_high[NCT6687_MAX_VOLTAGE];
+	u8 temp_max[NCT6687_MAX_TEMP];
+	u8 temp_hyst[NCT6687_MAX_TEMP];
+	u16 fan_min[NCT6687_MAX_FAN];
+
+	struct nct6687_stats stats;
+	struct dentry *debugfs;
+
+	struct nct6687_cooling cooling[NCT6687_NUM_REG_PWM];
+
+	/* Fan control saved by nct6687_suspend() for nct6687_resume() */
+	u8 pm_ctrl_mode;			/* FAN_CTRL_MODE byte, bit set per manual channel */
+	u8 pm_pwm[NCT6687_NUM_REG_PWM];	/* duty cycles of the manual channels */
+};
 
-struct sensor_template_group
+struct nct6687_sio_data
 {
-	struct sensor_device_template **templates;
-	umode_t (*is_visible)(struct kobject *, struct attribute *, int);
-	int base;
+	int sioreg;
+	enum kinds kind;
 };
 
 static void nct6687_save_fan_control(struct nct6687_data *data, int index);
+static void nct6687_queue_pwm(struct nct6687_data *data, unsigned long mask, const u8 *val);
 
-static const char* nct6687_voltage_label(char* buf, int index)
+/* Labels of the raw voltage inputs exposed with the manual parameter */
+static const char *const nct6687_manual_voltage_label[NCT6687_MAX_VOLTAGE] = {
+	"in0", "in1", "in2", "in3", "in4", "in5", "in6", "in7",
+	"in8", "in9", "in10", "in11", "in12", "in13", "in14", "in15",
+};
+
+static const char* nct6687_voltage_label(struct nct6687_data *data, char* buf, int index)
 {
 	if (manual)
 		sprintf(buf, "in%d", index);
 	else
-		strcpy(buf, nct6687_voltage_definition[index].label);
+		strcpy(buf, data->chip->voltage[index].label);
 
 	return buf;
 }
 
-static struct attribute_group *nct6687_create_attr_group(struct device *dev, const struct sensor_template_group *tg, int repeat)
+/* Register of a voltage in the sensor window, relative to NCT6687_REG_VOLTAGE(0) */
+static int nct6687_voltage_reg(struct nct6687_data *data, int index)
+{
+	return manual ? index : data->chip->voltage[index].reg;
+}
+
+/* Monitoring channel of a voltage, used by the limit and alarm registers */
+static int nct6687_voltage_mon_index(struct nct6687_data *data, int index)
 {
-	struct sensor_device_attribute_2 *a2;
-	struct sensor_device_attribute *a;
-	struct sensor_device_template **t;
-	struct sensor_device_attr_u *su;
-	struct attribute_group *group;
-	struct attribute **attrs;
-	int i, j, count;
+	return NCT6687_MON_VOLTAGE_BASE + nct6687_voltage_reg(data, index);
+}
 
-	if (repeat <= 0)
-		return ERR_PTR(-EINVAL);
+static int nct6687_voltage_multiplier(struct nct6687_data *data, int index)
+{
+	return manual ? 1 : data->chip->voltage[index].multiplier;
+}
 
-	t = tg->templates;
-	for (count = 0; *t; t++, count++)
-		;
+/* Voltage limits are 8 bit registers in 16 mV steps */
+static int nct6687_voltage_limit_from_reg(struct nct6687_data *data, int index, u8 reg)
+{
+	return reg * 16 * nct6687_voltage_multiplier(data, index);
+}
 
-	if (count == 0)
-		return ERR_PTR(-EINVAL);
+static u8 nct6687_voltage_limit_to_reg(struct nct6687_data *data, int index, long val)
+{
+	return clamp_val(DIV_ROUND_CLOSEST(val, 16 * nct6687_voltage_multiplier(data, index)), 0, 255);
+}
 
-	group = devm_kzalloc(dev, sizeof(*group), GFP_KERNEL);
-	if (group == NULL)
-		return ERR_PTR(-ENOMEM);
+static inline void nct6687_ec_outb(struct nct6687_data *data, u8 value, int offset)
+{
+	if (data->io_delay == NCT6687_IO_DELAY_PAUSED)
+	{
+		outb_p(value, data->addr + offset);
+		return;
+	}
 
-	attrs = devm_kcalloc(dev, repeat * count + 1, sizeof(*attrs), GFP_KERNEL);
-	if (attrs == NULL)
-		return ERR_PTR(-ENOMEM);
+	outb(value, data->addr + offset);
+	if (data->io_delay)
+		udelay(data->io_delay);
+}
 
-	su = devm_kzalloc(dev, array3_size(repeat, count, sizeof(*su)), GFP_KERNEL);
-	if (su == NULL)
-		return ERR_PTR(-ENOMEM);
+static inline u8 nct6687_ec_inb(struct nct6687_data *data, int offset)
+{
+	u8 value;
 
-	group->attrs = attrs;
-	group->is_visible = tg->is_visible;
+	if (data->io_delay == NCT6687_IO_DELAY_PAUSED)
+		return inb_p(data->addr + offset);
 
-	for (i = 0; i < repeat; i++)
-	{
-		t = tg->templates;
+	value = inb(data->addr + offset);
+	if (data->io_delay)
+		udelay(data->io_delay);
 
-		for (j = 0; *t != NULL; j++)
-		{
-			snprintf(su->name, sizeof(su->name), (*t)->dev_attr.attr.name, tg->base + i);
+	return value;
+}
 
-			if ((*t)->s2)
-			{
-				a2 = &su->u.a2;
-				sysfs_attr_init(&a2->dev_attr.attr);
-				a2->dev_attr.attr.name = su->name;
-				a2->nr = (*t)->u.s.nr + i;
-				a2->index = (*t)->u.s.index;
-				a2->dev_attr.attr.mode = (*t)->dev_attr.attr.mode;
-				a2->dev_attr.show = (*t)->dev_attr.show;
-				a2->dev_attr.store = (*t)->dev_attr.store;
-				*attrs = &a2->dev_attr.attr;
-			}
-			else
-			{
-				a = &su->u.a1;
-				sysfs_attr_init(&a->dev_attr.attr);
-				a->dev_attr.attr.name = su->name;
-				a->index = (*t)->u.index + i;
-				a->dev_attr.attr.mode = (*t)->dev_attr.attr.mode;
-				a->dev_attr.show = (*t)->dev_attr.show;
-				a->dev_attr.store = (*t)->dev_attr.store;
-				*attrs = &a->dev_attr.attr;
-			}
-			attrs++;
-			su++;
-			t++;
-		}
-	}
+/*
+ * The EC page register keeps its value between accesses, so only write it
+ * when the page actually changes. Anything that may have touched the EC
+ * behind our back (suspend/resume, BIOS or ACPI code accessing the same
+ * ports) must call nct6687_invalidate_page() to force a full re-select.
+ *
+ * Caller must hold EC_io_lock.
+ */
+static void nct6687_select_page(struct nct6687_data *data, u8 page)
+{
+	if (data->ec_page == page)
+		return;
 
-	return group;
+	nct6687_ec_outb(data, EC_SPACE_PAGE_SELECT, EC_SPACE_PAGE_REGISTER_OFFSET);
+	nct6687_ec_outb(data, page, EC_SPACE_PAGE_REGISTER_OFFSET);
+	data->ec_page = page;
+	atomic64_inc(&data->stats.page_switches);
 }
 
-static u16 nct6687_read(struct nct6687_data *data, u16 address)
+static void nct6687_invalidate_page(struct nct6687_data *data)
 {
-	u8 page = (u8)(address >> 8);
-	u8 index = (u8)(address & 0xFF);
-	int res;
 	mutex_lock(&data->EC_io_lock);
-	outb_p(EC_SPACE_PAGE_SELECT, data->addr + EC_SPACE_PAGE_REGISTER_OFFSET);
-	outb_p(page, data->addr + EC_SPACE_PAGE_REGISTER_OFFSET);
-	outb_p(index, data->addr + EC_SPACE_INDEX_REGISTER_OFFSET);
+	data->ec_page = -1;
 	mutex_unlock(&data->EC_io_lock);
-	res = inb_p(data->addr + EC_SPACE_DATA_REGISTER_OFFSET);
-
-	return res;
 }
 
-static u16 nct6687_read16(struct nct6687_data *data, u16 reg)
+static u8 nct6687_port_read(struct nct6687_data *data, u16 address)
 {
-	return (nct6687_read(data, reg) << 8) | nct6687_read(data, reg + 1);
+	nct6687_select_page(data, (u8)(address >> 8));
+	nct6687_ec_outb(data, (u8)(address & 0xFF), EC_SPACE_INDEX_REGISTER_OFFSET);
+
+	return nct6687_ec_inb(data, EC_SPACE_DATA_REGISTER_OFFSET);
 }
 
-static void nct6687_write(struct nct6687_data *data, u16 address, u16 value)
+static void nct6687_port_write(struct nct6687_data *data, u16 address, u8 value)
 {
-	u8 page = (u8)(address >> 8);
-	u8 index = (u8)(address & 0xFF);
-	mutex_lock(&data->EC_io_lock);
-	outb_p(EC_SPACE_PAGE_SELECT, data->addr + EC_SPACE_PAGE_REGISTER_OFFSET);
-	outb_p(page, data->addr + EC_SPACE_PAGE_REGISTER_OFFSET);
-	outb_p(index, data->addr + EC_SPACE_INDEX_REGISTER_OFFSET);
-	outb_p(value, data->addr + EC_SPACE_DATA_REGISTER_OFFSET);
-	mutex_unlock(&data->EC_io_lock);
+	nct6687_select_page(data, (u8)(address >> 8));
+	nct6687_ec_outb(data, (u8)(address & 0xFF), EC_SPACE_INDEX_REGISTER_OFFSET);
+	nct6687_ec_outb(data, value, EC_SPACE_DATA_REGISTER_OFFSET);
 }
 
-static void nct6687_update_temperatures(struct nct6687_data *data)
+/* EC behind the paged index/data ports of the Super-I/O HWM logical device */
+static const struct nct6687_ec_ops nct6687_port_ops = {
+	.name = "port",
+	.read = nct6687_port_read,
+	.write = nct6687_port_write,
+};
+
+/*
+ * Simulated chip: temperatures follow a triangle wave of sim_period between
+ * 30 and 60 C, offset by 2 C per channel, and fan speeds follow the PWM
+ * values. Everything else reads back the last value written.
+ */
+static void nct6687_sim_update(struct nct6687_data *data, u16 address)
 {
+	struct nct6687_sim *sim = data->sim;
+	unsigned int period = max(READ_ONCE(sim_period), 1);
+	unsigned int phase = jiffies_to_msecs(jiffies - sim->start) % period;
+	unsigned int wave = phase < period / 2 ? phase : period - phase; /* 0 to period / 2 */
+	u16 rpm;
 	int i;
 
-	for (i = 0; i < NCT6687_NUM_REG_TEMP; i++)
+	if (address >= NCT6687_REG_TEMP(0) && address < NCT6687_REG_TEMP(NCT6687_MAX_TEMP) && !(address & 1))
 	{
-		s32 value = (char)nct6687_read(data, NCT6687_REG_TEMP(i));
-		s32 half = (nct6687_read(data, NCT6687_REG_TEMP(i) + 1) >> 7) & 0x1;
-		s32 temperature = (value * 1000) + (500 * half);
+		s32 temp = 30000 + 2000 * ((address - NCT6687_REG_TEMP(0)) / 2) + div_u64((u64)wave * 60000, period);
 
-		data->temperature[0][i] = temperature;
-		data->temperature[1][i] = MIN(temperature, data->temperature[1][i]);
-		data->temperature[2][i] = MAX(temperature, data->temperature[2][i]);
+		sim->regs[address] = temp / 1000;
+		sim->regs[address + 1] = (temp % 1000) >= 500 ? 0x80 : 0;
+	}
+	else if (address >= NCT6687_REG_FAN_RPM(0) && address < NCT6687_REG_FAN_RPM(NCT6687_MAX_FAN) && !(address & 1))
+	{
+		i = (address - NCT6687_REG_FAN_RPM(0)) / 2;
+		rpm = i < NCT6687_NUM_REG_PWM ? 300 + sim->regs[NCT6687_REG_PWM(i)] * 8 : 0;
 
-		pr_debug("nct6687_update_temperatures[%d]], addr=%04X, value=%d, half=%d, temperature=%d\n", i, NCT6687_REG_TEMP(i), value, half, temperature);
+		sim->regs[address] = rpm >> 8;
+		sim->regs[address + 1] = rpm & 0xFF;
 	}
 }
 
-static void nct6687_update_voltage(struct nct6687_data *data)
+static u8 nct6687_sim_read(struct nct6687_data *data, u16 address)
 {
-	int index;
-	char buf[128];
-
-	/* Measured voltages and limits */
-	for (index = 0; index < NCT6687_NUM_REG_VOLTAGE; index++)
-	{
-		s16 reg = manual ? index : nct6687_voltage_definition[index].reg;
-		s16 high = nct6687_read(data, NCT6687_REG_VOLTAGE(reg)) * 16;
-		s16 low = ((u16)nct6687_read(data, NCT6687_REG_VOLTAGE(reg) + 1)) >> 4;
-		s16 value = low + high;
-		s16 voltage = manual ? value : value * nct6687_voltage_definition[index].multiplier;
+	int latency = READ_ONCE(sim_latency);
 
-		data->voltage[0][index] = voltage;
-		data->voltage[1][index] = MIN(voltage, data->voltage[1][index]);
-		data->voltage[2][index] = MAX(voltage, data->voltage[2][index]);
+	if (latency > 0)
+		ndelay(latency);
 
-		pr_debug("nct6687_update_voltage[%d], %s, reg=%d, addr=0x%04x, value=%d, voltage=%d\n", index, nct6687_voltage_label(buf, index), reg, NCT6687_REG_VOLTAGE(index), value, voltage);
-	}
+	nct6687_sim_update(data, address);
 
-	pr_debug("nct6687_update_voltage\n");
+	return data->sim->regs[address];
 }
 
-static enum pwm_enable nct6687_get_pwm_enable(struct nct6687_data *data, int index)
+static void nct6687_sim_write(struct nct6687_data *data, u16 address, u8 value)
 {
-	u16 bitMask = 0x01 << index;
-	if (nct6687_read(data, NCT6687_REG_FAN_CTRL_MODE(index)) & bitMask)
+	struct nct6687_sim *sim = data->sim;
+	int latency = READ_ONCE(sim_latency);
+	int i;
+
+	if (latency > 0)
+		ndelay(latency);
+
+	sim->regs[address] = value;
+
+	/* The end of a PWM handshake applies the PWM_WRITE values */
+	if (address == NCT6687_REG_FAN_PWM_COMMAND(0) && value == NCT6687_FAN_CFG_DONE)
 	{
-		return manual_mode;
+		for (i = 0; i < NCT6687_NUM_REG_PWM; i++)
+			sim->regs[NCT6687_REG_PWM(i)] = sim->regs[NCT6687_REG_PWM_WRITE(i)];
 	}
-	return firmware_mode;
 }
 
-static void nct6687_update_fans(struct nct6687_data *data)
+static const struct nct6687_ec_ops nct6687_sim_ops = {
+	.name = "sim",
+	.read = nct6687_sim_read,
+	.write = nct6687_sim_write,
+};
+
+static int nct6687_sim_init(struct device *dev, struct nct6687_data *data)
 {
+	struct nct6687_sim *sim;
 	int i;
 
-	for (i = 0; i < NCT6687_NUM_REG_FAN; i++)
-	{
-		s16 rmp = nct6687_read16(data, NCT6687_REG_FAN_RPM(i));
+	sim = devm_kzalloc(dev, sizeof(*sim), GFP_KERNEL);
+	if (!sim)
+		return -ENOMEM;
 
-		data->rpm[0][i] = rmp;
-		data->rpm[1][i] = MIN(rmp, data->rpm[1][i]);
-		data->rpm[2][i] = MAX(rmp, data->rpm[2][i]);
+	sim->start = jiffies;
+	sim->regs[NCT6687_REG_VERSION_HI] = 0x01;
+	sim->regs[NCT6687_HWM_CFG] = 0x80;
 
-		pr_debug("nct6687_update_fans[%d], rpm=%d min=%d, max=%d", i, rmp, data->rpm[1][i], data->rpm[2][i]);
+	/* About 1 V on every voltage input */
+	for (i = 0; i < (NCT6687_REG_FAN_RPM(0) - NCT6687_REG_VOLTAGE(0)) / 2; i++)
+	{
+		sim->regs[NCT6687_REG_VOLTAGE(i)] = 62;
+		sim->regs[NCT6687_REG_VOLTAGE(i) + 1] = 8 << 4;
 	}
 
 	for (i = 0; i < NCT6687_NUM_REG_PWM; i++)
 	{
-		data->pwm[i] = nct6687_read(data, NCT6687_REG_PWM(i));
-		data->pwm_enable[i] = nct6687_get_pwm_enable(data, i);
-
-		pr_debug("nct6687_update_fans[%d], pwm=%d", i, data->pwm[i]);
+		sim->regs[NCT6687_REG_PWM(i)] = 128;
+		sim->regs[NCT6687_REG_PWM_WRITE(i)] = 128;
 	}
+
+	data->sim = sim;
+
+	return 0;
 }
 
-static struct nct6687_data *nct6687_update_device(struct device *dev)
+/*
+ * regmap access to the EC space. Configuration registers that only change
+ * through this driver are cached, everything else, including the whole
+ * sensor window, is volatile.
+ */
+/* Below the register cache: counters and tracepoints only see real EC accesses */
+static int nct6687_regmap_read(void *context, unsigned int reg, unsigned int *val)
 {
-	struct nct6687_data *data = dev_get_drvdata(dev);
+	struct nct6687_data *data = context;
+	u64 start = trace_nct6687_ec_read_enabled() ? ktime_get_ns() : 0;
 
-	mutex_lock(&data->update_lock);
+	*val = data->ec_ops->read(data, reg);
+	atomic64_inc(&data->stats.ec_reads);
 
-	if (time_after(jiffies, data->last_updated + HZ) || !data->valid)
-	{
-		/* Measured voltages and limits */
-		nct6687_update_voltage(data);
+	/* Only time calls that started with the event enabled */
+	if (start)
+		trace_nct6687_ec_read(reg, *val, ktime_get_ns() - start);
 
-		/* Measured temperatures and limits */
-		nct6687_update_temperatures(data);
+	return 0;
+}
 
-		/* Measured fan speeds and limits */
-		nct6687_update_fans(data);
+static int nct6687_regmap_write(void *context, unsigned int reg, unsigned int val)
+{
+	struct nct6687_data *data = context;
+	u64 start = trace_nct6687_ec_write_enabled() ? ktime_get_ns() : 0;
 
-		data->last_updated = jiffies;
-		data->valid = true;
-	}
+	data->ec_ops->write(data, reg, val);
+	atomic64_inc(&data->stats.ec_writes);
 
-	mutex_unlock(&data->update_lock);
+	if (start)
+		trace_nct6687_ec_write(reg, val, ktime_get_ns() - start);
 
-	return data;
+	return 0;
 }
 
-/*
- * Sysfs callback functions
- */
-static ssize_t show_voltage_label(struct device *dev, struct device_attribute *attr, char *buf)
+static bool nct6687_volatile_reg(struct device *dev, unsigned int reg)
 {
-	struct sensor_device_attribute *sattr = to_sensor_dev_attr(attr);
-
-	if (manual)
-		return sprintf(buf, "in%d\n", sattr->index);
-	else
-		return sprintf(buf, "%s\n", nct6687_voltage_definition[sattr->index].label);
+	switch (reg)
+	{
+	case NCT6687_REG_FAN_CTRL_MODE(0):
+	case NCT6687_HWM_CFG:
+	case NCT6687_REG_BUILD_YEAR:
+	case NCT6687_REG_BUILD_MONTH:
+	case NCT6687_REG_BUILD_DAY:
+	case NCT6687_REG_SERIAL:
+	case NCT6687_REG_VERSION_HI:
+	case NCT6687_REG_VERSION_LO:
+		return false;
+	default:
+		/* Sensor window, alarms, limits and the PWM handshake registers */
+		return true;
+	}
 }
 
-static ssize_t show_voltage_value(struct device *dev, struct device_attribute *attr, char *buf)
+/* Keeps regcache_sync() away from the read-only firmware identification */
+static bool nct6687_writeable_reg(struct device *dev, unsigned int reg)
 {
-	struct sensor_device_attribute_2 *sattr = to_sensor_dev_attr_2(attr);
-	struct nct6687_data *data = nct6687_update_device(dev);
-
-	return sprintf(buf, "%d\n", data->voltage[sattr->index][sattr->nr]);
+	return reg < NCT6687_REG_BUILD_YEAR || reg > NCT6687_REG_VERSION_LO;
 }
 
-static umode_t nct6687_voltage_is_visible(struct kobject *kobj, struct attribute *attr, int index)
+/* regmap serializes EC access with EC_io_lock, which also covers ec_page */
+static void nct6687_regmap_lock(void *context)
 {
-	pr_debug("nct6687_voltage_is_visible[%d], attr=0x%04X\n", index, attr->mode);
-	return attr->mode;
+	struct nct6687_data *data = context;
+
+	mutex_lock(&data->EC_io_lock);
 }
 
-SENSOR_TEMPLATE(voltage_label, "in%d_label", S_IRUGO, show_voltage_label, NULL, 0);
-SENSOR_TEMPLATE_2(voltage_input, "in%d_input", S_IRUGO, show_voltage_value, NULL, 0, 0);
-SENSOR_TEMPLATE_2(voltage_min, "in%d_min", S_IRUGO, show_voltage_value, NULL, 0, 1);
-SENSOR_TEMPLATE_2(voltage_max, "in%d_max", S_IRUGO, show_voltage_value, NULL, 0, 2);
+static void nct6687_regmap_unlock(void *context)
+{
+	struct nct6687_data *data = context;
 
-static struct sensor_device_template *nct6687_attributes_voltage_template[] = {
-	&sensor_dev_template_voltage_label,
-	&sensor_dev_template_voltage_input,
-	&sensor_dev_template_voltage_min,
-	&sensor_dev_template_voltage_max,
-	NULL,
-};
+	mutex_unlock(&data->EC_io_lock);
+}
 
-static const struct sensor_template_group nct6687_voltage_template_group = {
-	.templates = nct6687_attributes_voltage_template,
-	.is_visible = nct6687_voltage_is_visible,
+static const struct regmap_config nct6687_regmap_config = {
+	.name = "ec",
+	.reg_bits = 16,
+	.val_bits = 8,
+	.max_register = NCT6687_REG_PWM_WRITE(NCT6687_NUM_REG_PWM - 1),
+	.reg_read = nct6687_regmap_read,
+	.reg_write = nct6687_regmap_write,
+	.volatile_reg = nct6687_volatile_reg,
+	.writeable_reg = nct6687_writeable_reg,
+	.cache_type = REGCACHE_RBTREE,
+	.lock = nct6687_regmap_lock,
+	.unlock = nct6687_regmap_unlock,
 };
 
-static ssize_t show_fan_label(struct device *dev, struct device_attribute *attr, char *buf)
+static u16 nct6687_read(struct nct6687_data *data, u16 address)
 {
-	struct sensor_device_attribute *sattr = to_sensor_dev_attr(attr);
+	unsigned int res = 0;
 
-	return sprintf(buf, "%s\n", nct6687_fan_label[sattr->index]);
-}
-
-static ssize_t show_fan_value(struct device *dev, struct device_attribute *attr, char *buf)
-{
-	struct sensor_device_attribute_2 *sattr = to_sensor_dev_attr_2(attr);
-	struct nct6687_data *data = nct6687_update_device(dev);
+	regmap_read(data->regmap, address, &res);
 
-	return sprintf(buf, "%d\n", data->rpm[sattr->index][sattr->nr]);
+	return res;
 }
 
-static umode_t nct6687_fan_is_visible(struct kobject *kobj, struct attribute *attr, int index)
+static u16 nct6687_read16(struct nct6687_data *data, u16 reg)
 {
-	return attr->mode;
+	return (nct6687_read(data, reg) << 8) | nct6687_read(data, reg + 1);
 }
 
-SENSOR_TEMPLATE(fan_label, "fan%d_label", S_IRUGO, show_fan_label, NULL, 0);
-SENSOR_TEMPLATE_2(fan_input, "fan%d_input", S_IRUGO, show_fan_value, NULL, 0, 0);
-SENSOR_TEMPLATE_2(fan_min, "fan%d_min", S_IRUGO, show_fan_value, NULL, 0, 1);
-SENSOR_TEMPLATE_2(fan_max, "fan%d_max", S_IRUGO, show_fan_value, NULL, 0, 2);
-
 /*
- * nct6687_fan_is_visible uses the index into the following array
- * to determine if attributes should be created or not.
- * Any change in order or content must be matched.
+ * Read len consecutive EC registers starting at start into buf, taking
+ * EC_io_lock only once for the whole range.
  */
-static struct sensor_device_template *nct6687_attributes_fan_template[] = {
-	&sensor_dev_template_fan_label,
-	&sensor_dev_template_fan_input,
-	&sensor_dev_template_fan_min,
-	&sensor_dev_template_fan_max,
-	NULL,
-};
+static void nct6687_read_block(struct nct6687_data *data, u16 start, u16 len, u8 *buf)
+{
+	u64 begin = trace_nct6687_ec_read_block_enabled() ? ktime_get_ns() : 0;
 
-static const struct sensor_template_group nct6687_fan_template_group = {
-	.templates = nct6687_attributes_fan_template,
-	.is_visible = nct6687_fan_is_visible,
-	.base = 1,
-};
+	if (regmap_bulk_read(data->regmap, start, buf, len))
+		memset(buf, 0, len);
 
-static ssize_t show_temperature_label(struct device *dev, struct device_attribute *attr, char *buf)
-{
-	struct sensor_device_attribute *sattr = to_sensor_dev_attr(attr);
+	if (begin)
+		trace_nct6687_ec_read_block(start, len, ktime_get_ns() - begin);
+}
 
-	return sprintf(buf, "%s\n", nct6687_temp_label[sattr->index]);
+/* Fetch a register range of the sensor window into the raw snapshot buffer */
+static void nct6687_read_window(struct nct6687_data *data, u16 start, u16 len)
+{
+	nct6687_read_block(data, start, len, &data->window[start - NCT6687_SENSOR_WINDOW_BASE]);
 }
 
-static ssize_t show_temperature_value(struct device *dev, struct device_attribute *attr, char *buf)
+static inline u8 nct6687_window_read(struct nct6687_data *data, u16 reg)
 {
-	struct sensor_device_attribute_2 *sattr = to_sensor_dev_attr_2(attr);
-	struct nct6687_data *data = nct6687_update_device(dev);
+	return data->window[reg - NCT6687_SENSOR_WINDOW_BASE];
+}
 
-	return sprintf(buf, "%d\n", data->temperature[sattr->index][sattr->nr]);
+static inline u16 nct6687_window_read16(struct nct6687_data *data, u16 reg)
+{
+	return (nct6687_window_read(data, reg) << 8) | nct6687_window_read(data, reg + 1);
 }
 
-static umode_t nct6687_temp_is_visible(struct kobject *kobj, struct attribute *attr, int index)
+static void nct6687_write(struct nct6687_data *data, u16 address, u16 value)
 {
-	return attr->mode;
+	regmap_write(data->regmap, address, value);
 }
 
-SENSOR_TEMPLATE(temp_label, "temp%d_label", S_IRUGO, show_temperature_label, NULL, 0);
-SENSOR_TEMPLATE_2(temp_input, "temp%d_input", S_IRUGO, show_temperature_value, NULL, 0, 0);
-SENSOR_TEMPLATE_2(temp_min, "temp%d_min", S_IRUGO, show_temperature_value, NULL, 0, 1);
-SENSOR_TEMPLATE_2(temp_max, "temp%d_max", S_IRUGO, show_temperature_value, NULL, 0, 2);
+/* Row of the history ring the current refresh fills, NULL without history */
+static s32 *nct6687_history_row(struct nct6687_data *data, int class)
+{
+	struct nct6687_history *h = &data->history[class];
 
-/*
- * nct6687_temp_is_visible uses the index into the following array
- * to determine if attributes should be created or not.
- * Any change in order or content must be matched.
- */
-static struct sensor_device_template *nct6687_attributes_temp_template[] = {
-	&sensor_dev_template_temp_input,
-	&sensor_dev_template_temp_label,
-	&sensor_dev_template_temp_min,
-	&sensor_dev_template_temp_max,
-	NULL,
-};
+	if (!data->history_depth)
+		return NULL;
 
-static const struct sensor_template_group nct6687_temp_template_group = {
-	.templates = nct6687_attributes_temp_template,
-	.is_visible = nct6687_temp_is_visible,
-	.base = 1,
-};
+	return h->samples + h->head * NCT6687_HISTORY_CHANNELS;
+}
 
-static ssize_t show_pwm(struct device *dev, struct device_attribute *attr, char *buf)
+/* Account the row filled by the current refresh for the channels in have */
+static void nct6687_history_commit(struct nct6687_data *data, int class, unsigned long have)
 {
-	struct nct6687_data *data = nct6687_update_device(dev);
-	struct sensor_device_attribute_2 *sattr = to_sensor_dev_attr_2(attr);
-	int index = sattr->index;
+	struct nct6687_history *h = &data->history[class];
+	int i;
 
-	return sprintf(buf, "%d\n", data->pwm[index]);
+	if (!data->history_depth)
+		return;
+
+	h->head = (h->head + 1) % data->history_depth;
+
+	for_each_set_bit(i, &have, NCT6687_HISTORY_CHANNELS)
+	{
+		if (h->count[i] < data->history_depth)
+			h->count[i]++;
+	}
 }
 
-static ssize_t store_pwm(struct device *dev, struct device_attribute *attr, const char *buf, size_t count)
+/* History attributes, index selects the statistic */
+enum nct6687_history_attr
 {
-	struct sensor_device_attribute_2 *sattr = to_sensor_dev_attr_2(attr);
-	struct nct6687_data *data = dev_get_drvdata(dev);
-	int index = sattr->index;
-	unsigned long val;
-	int retry;
-	u16 readback;
-	u16 mode;
+	history_attr_average,
+	history_attr_lowest,
+	history_attr_highest,
+};
+
+/* Compute a statistic over the recorded samples of a channel. Caller must hold update_lock. */
+static int nct6687_history_value(struct nct6687_data *data, int class, int channel, int attr, long *val)
+{
+	struct nct6687_history *h = &data->history[class];
+	unsigned int n = h->count[channel];
+	unsigned int row = h->head;
+	s32 low = S32_MAX, high = S32_MIN;
+	s64 sum = 0;
+	unsigned int i;
+
+	if (n == 0)
+		return -ENODATA;
+
+	for (i = 0; i < n; i++)
+	{
+		s32 value;
+
+		row = row ? row - 1 : data->history_depth - 1;
+		value = h->samples[row * NCT6687_HISTORY_CHANNELS + channel];
+
+		sum += value;
+		low = min(low, value);
+		high = max(high, value);
+	}
+
+	switch (attr)
+	{
+	case history_attr_average:
+		*val = div_s64(sum, n);
+		break;
+	case history_attr_lowest:
+		*val = low;
+		break;
+	default:
+		*val = high;
+		break;
+	}
+
+	return 0;
+}
+
+static int nct6687_allocate_history(struct device *dev, struct nct6687_data *data)
+{
+	unsigned int depth = clamp_val(history_depth, 0, NCT6687_HISTORY_DEPTH_MAX);
+	int i;
+
+	BUILD_BUG_ON(NCT6687_MAX_VOLTAGE > NCT6687_HISTORY_CHANNELS);
+	BUILD_BUG_ON(NCT6687_MAX_TEMP > NCT6687_HISTORY_CHANNELS);
+	BUILD_BUG_ON(NCT6687_MAX_FAN > NCT6687_HISTORY_CHANNELS);
+
+	if (!depth)
+		return 0;
+
+	for (i = 0; i < NCT6687_NUM_HISTORY; i++)
+	{
+		data->history[i].samples = devm_kcalloc(dev, depth * NCT6687_HISTORY_CHANNELS, sizeof(s32), GFP_KERNEL);
+		if (!data->history[i].samples)
+			return -ENOMEM;
+	}
+
+	data->history_depth = depth;
+
+	return 0;
+}
+
+/* Monitoring and fan alarm status, fetched with a single block read */
+static void nct6687_update_alarms(struct nct6687_data *data)
+{
+	int i;
+
+	nct6687_read_window(data, NCT6687_REG_MON_STS(0), NCT6687_REG_FAN_STS(1) - NCT6687_REG_MON_STS(0) + 1);
+
+	data->shadow.mon_alarms = 0;
+	for (i = 0; i < 4; i++)
+		data->shadow.mon_alarms |= (u32)nct6687_window_read(data, NCT6687_REG_MON_STS(i)) << (i * 8);
+
+	data->shadow.fan_alarms = nct6687_window_read(data, NCT6687_REG_FAN_STS(0)) |
+							  (nct6687_window_read(data, NCT6687_REG_FAN_STS(1)) << 8);
+}
+
+static void nct6687_update_temperatures(struct nct6687_data *data)
+{
+	bool seed = !(data->sampled & NCT6687_UPDATE_TEMP);
+	s32 *row = nct6687_history_row(data, NCT6687_CLASS_TEMP);
+	int i;
+
+	if (data->have_temp)
+	{
+		int first = __ffs(data->have_temp), last = __fls(data->have_temp);
+
+		nct6687_read_window(data, NCT6687_REG_TEMP(first), (last - first + 1) * 2);
+	}
+
+	for_each_set_bit(i, &data->have_temp, NCT6687_MAX_TEMP)
+	{
+		s32 value = (char)nct6687_window_read(data, NCT6687_REG_TEMP(i));
+		s32 half = (nct6687_window_read(data, NCT6687_REG_TEMP(i) + 1) >> 7) & 0x1;
+		s32 temperature = (value * 1000) + (500 * half);
+
+		data->shadow.temperature[0][i] = temperature;
+		data->shadow.temperature[1][i] = seed ? temperature : MIN(temperature, data->shadow.temperature[1][i]);
+		data->shadow.temperature[2][i] = seed ? temperature : MAX(temperature, data->shadow.temperature[2][i]);
+		if (row)
+			row[i] = temperature;
+
+		pr_debug("nct6687_update_temperatures[%d]], addr=%04X, value=%d, half=%d, temperature=%d\n", i, NCT6687_REG_TEMP(i), value, half, temperature);
+	}
+
+	nct6687_history_commit(data, NCT6687_CLASS_TEMP, data->have_temp);
+}
+
+static void nct6687_update_voltage(struct nct6687_data *data)
+{
+	bool seed = !(data->sampled & NCT6687_UPDATE_VOLTAGE);
+	s32 *row = nct6687_history_row(data, NCT6687_CLASS_VOLTAGE);
+	int first = -1, last = -1;
+	int index;
+	char buf[128];
+
+	/* Voltage registers are not in channel order, read the span of the monitored ones */
+	for_each_set_bit(index, &data->have_in, NCT6687_MAX_VOLTAGE)
+	{
+		int reg = nct6687_voltage_reg(data, index);
+
+		if (first < 0 || reg < first)
+			first = reg;
+		if (reg > last)
+			last = reg;
+	}
+
+	if (first >= 0)
+		nct6687_read_window(data, NCT6687_REG_VOLTAGE(first), (last - first + 1) * 2);
+
+	/* Measured voltages and limits */
+	for_each_set_bit(index, &data->have_in, NCT6687_MAX_VOLTAGE)
+	{
+		s16 reg = nct6687_voltage_reg(data, index);
+		s16 high = nct6687_window_read(data, NCT6687_REG_VOLTAGE(reg)) * 16;
+		s16 low = ((u16)nct6687_window_read(data, NCT6687_REG_VOLTAGE(reg) + 1)) >> 4;
+		s16 value = low + high;
+		s16 voltage = value * nct6687_voltage_multiplier(data, index);
+
+		data->shadow.voltage[0][index] = voltage;
+		data->shadow.voltage[1][index] = seed ? voltage : MIN(voltage, data->shadow.voltage[1][index]);
+		data->shadow.voltage[2][index] = seed ? voltage : MAX(voltage, data->shadow.voltage[2][index]);
+		if (row)
+			row[index] = voltage;
+
+		pr_debug("nct6687_update_voltage[%d], %s, reg=%d, addr=0x%04x, value=%d, voltage=%d\n", index, nct6687_voltage_label(data, buf, index), reg, NCT6687_REG_VOLTAGE(index), value, voltage);
+	}
+
+	nct6687_history_commit(data, NCT6687_CLASS_VOLTAGE, data->have_in);
+
+	pr_debug("nct6687_update_voltage\n");
+}
+
+/* Decode the pwm_enable value of a channel from the cached FAN_CTRL_MODE byte */
+static enum pwm_enable nct6687_get_pwm_enable(struct nct6687_data *data, int index)
+{
+	u16 bitMask = 0x01 << index;
+	if (READ_ONCE(data->fan_ctrl_mode) & bitMask)
+	{
+		return manual_mode;
+	}
+	return firmware_mode;
+}
+
+/* Refresh the cached FAN_CTRL_MODE byte shared by all channels */
+static void nct6687_update_fan_ctrl_mode(struct nct6687_data *data)
+{
+	WRITE_ONCE(data->fan_ctrl_mode, nct6687_read(data, NCT6687_REG_FAN_CTRL_MODE(0)));
+}
+
+static void nct6687_update_fans(struct nct6687_data *data)
+{
+	bool seed = !(data->sampled & NCT6687_UPDATE_FAN);
+	s32 *row = nct6687_history_row(data, NCT6687_CLASS_FAN);
+	int i;
+
+	if (data->have_fan)
+	{
+		int first = __ffs(data->have_fan), last = __fls(data->have_fan);
+
+		nct6687_read_window(data, NCT6687_REG_FAN_RPM(first), (last - first + 1) * 2);
+	}
+
+	for_each_set_bit(i, &data->have_fan, NCT6687_MAX_FAN)
+	{
+		s16 rmp = nct6687_window_read16(data, NCT6687_REG_FAN_RPM(i));
+
+		data->shadow.rpm[0][i] = rmp;
+		data->shadow.rpm[1][i] = seed ? rmp : MIN(rmp, data->shadow.rpm[1][i]);
+		data->shadow.rpm[2][i] = seed ? rmp : MAX(rmp, data->shadow.rpm[2][i]);
+		if (row)
+			row[i] = rmp;
+
+		pr_debug("nct6687_update_fans[%d], rpm=%d min=%d, max=%d", i, rmp, data->shadow.rpm[1][i], data->shadow.rpm[2][i]);
+	}
+
+	nct6687_history_commit(data, NCT6687_CLASS_FAN, data->have_fan);
+}
+
+static void nct6687_update_pwm(struct nct6687_data *data)
+{
+	int i;
+
+	nct6687_read_window(data, NCT6687_REG_PWM(0), NCT6687_NUM_REG_PWM);
+	nct6687_update_fan_ctrl_mode(data);
+
+	for (i = 0; i < NCT6687_NUM_REG_PWM; i++)
+	{
+		data->shadow.pwm[i] = nct6687_window_read(data, NCT6687_REG_PWM(i));
+		data->shadow.pwm_enable[i] = nct6687_get_pwm_enable(data, i);
+
+		pr_debug("nct6687_update_pwm[%d], pwm=%d", i, data->shadow.pwm[i]);
+	}
+}
+
+/* Indexed by enum nct6687_sensor_class */
+static void (*const nct6687_update_class[NCT6687_NUM_CLASS])(struct nct6687_data *data) = {
+	[NCT6687_CLASS_VOLTAGE] = nct6687_update_voltage,
+	[NCT6687_CLASS_TEMP] = nct6687_update_temperatures,
+	[NCT6687_CLASS_FAN] = nct6687_update_fans,
+	[NCT6687_CLASS_PWM] = nct6687_update_pwm,
+};
+
+/* Interpolate the PWM value of a curve at temperature temp */
+static u8 nct6687_curve_target(const struct nct6687_fan_curve *curve, s32 temp)
+{
+	int i;
+
+	if (temp <= curve->temp[0])
+		return curve->pwm[0];
+
+	for (i = 1; i < NCT6687_CURVE_POINTS; i++)
+	{
+		if (temp < curve->temp[i])
+		{
+			s32 t0 = curve->temp[i - 1], t1 = curve->temp[i];
+			s32 p0 = curve->pwm[i - 1], p1 = curve->pwm[i];
+
+			if (t1 <= t0)
+				return p1;
+
+			return p0 + (p1 - p0) * (temp - t0) / (t1 - t0);
+		}
+	}
+
+	return curve->pwm[NCT6687_CURVE_POINTS - 1];
+}
+
+/*
+ * Evaluate the fan curve of every channel in curve_mode against the latest
+ * temperatures and queue a PWM write for the channels whose output changes.
+ * Decreases are held back until the source cooled down by the hysteresis,
+ * and changes are limited to ramp_rate PWM steps per second.
+ * Caller must hold update_lock.
+ */
+static void nct6687_update_curves(struct nct6687_data *data)
+{
+	unsigned long curves = data->curve_enabled;
+	u8 values[NCT6687_NUM_REG_PWM];
+	unsigned long mask = 0;
+	int i, j;
+
+	for_each_set_bit(i, &curves, NCT6687_NUM_REG_PWM)
+	{
+		struct nct6687_fan_curve *curve = &data->curve[i];
+		unsigned long sources;
+		bool found = false;
+		s32 temp = 0;
+		int target;
+
+		/* Temperatures hidden by temp_mask are never refreshed */
+		sources = curve->temp_channels & data->have_temp;
+
+		for_each_set_bit(j, &sources, NCT6687_MAX_TEMP)
+		{
+			if (!found || data->shadow.temperature[0][j] > temp)
+				temp = data->shadow.temperature[0][j];
+			found = true;
+		}
+
+		if (!found)
+			continue;
+
+		target = nct6687_curve_target(curve, temp);
+
+		if (curve->output_valid)
+		{
+			if (target < curve->output && temp > curve->output_temp - curve->hyst)
+				target = curve->output;
+
+			if (curve->ramp_rate)
+			{
+				int step = curve->ramp_rate * jiffies_to_msecs(jiffies - curve->output_time) / 1000;
+
+				step = MAX(step, 1);
+				target = clamp_val(target, curve->output - step, curve->output + step);
+			}
+
+			if (target == curve->output)
+				continue;
+		}
+
+		curve->output = target;
+		curve->output_temp = temp;
+		curve->output_time = jiffies;
+		curve->output_valid = true;
+
+		values[i] = target;
+		mask |= BIT(i);
+
+		pr_debug("nct6687_update_curves[%d], temp=%d, pwm=%d\n", i, temp, target);
+	}
+
+	if (mask)
+		nct6687_queue_pwm(data, mask, values);
+}
+
+/* Make the shadow sensor values visible to readers. Caller must hold update_lock. */
+static void nct6687_publish(struct nct6687_data *data)
+{
+	write_seqlock(&data->sample_lock);
+	data->sensors = data->shadow;
+	write_sequnlock(&data->sample_lock);
+}
+
+/* Report the *_alarm attributes whose status bit changed to the hwmon core */
+static void nct6687_notify_alarms(struct nct6687_data *data, u32 mon_changed, u16 fan_changed)
+{
+	int i;
+
+	if (!data->hwmon_dev)
+		return;
+
+	for (i = 0; i < data->chip->num_voltage; i++)
+	{
+		if (mon_changed & BIT(nct6687_voltage_mon_index(data, i)))
+			hwmon_notify_event(data->hwmon_dev, hwmon_in, hwmon_in_alarm, i);
+	}
+
+	for (i = 0; i < data->chip->num_temp; i++)
+	{
+		if (mon_changed & BIT(i))
+			hwmon_notify_event(data->hwmon_dev, hwmon_temp, hwmon_temp_alarm, i);
+	}
+
+	for (i = 0; i < data->chip->num_fan; i++)
+	{
+		if (fan_changed & BIT(i))
+			hwmon_notify_event(data->hwmon_dev, hwmon_fan, hwmon_fan_alarm, i);
+	}
+}
+
+/* Read the sensor classes in the classes mask from the EC. Caller must hold update_lock. */
+static void nct6687_refresh(struct nct6687_data *data, unsigned int classes)
+{
+	u32 mon_alarms = data->sensors.mon_alarms;
+	u16 fan_alarms = data->sensors.fan_alarms;
+	u64 start = ktime_get_ns();
+	u64 duration;
+	int i;
+
+	trace_nct6687_refresh_start(classes);
+
+	for (i = 0; i < NCT6687_NUM_CLASS; i++)
+	{
+		if (!(classes & BIT(i)))
+			continue;
+
+		nct6687_update_class[i](data);
+	}
+
+	/* Once per refresh, however many classes share the status registers */
+	if (hw_limits && (classes & NCT6687_UPDATE_ALARMS))
+		nct6687_update_alarms(data);
+
+	data->shadow.generation++;
+	data->shadow.updated = jiffies;
+	data->shadow.updated_ns = ktime_get_ns();
+	nct6687_publish(data);
+
+	duration = data->shadow.updated_ns - start;
+	atomic64_inc(&data->stats.refreshes);
+	atomic64_add(duration, &data->stats.refresh_ns);
+	if (duration > data->stats.refresh_max_ns)
+		WRITE_ONCE(data->stats.refresh_max_ns, duration);
+
+	trace_nct6687_refresh_end(classes, data->shadow.generation, duration);
+
+	/* Only mark the classes fresh once readers can see their values */
+	for (i = 0; i < NCT6687_NUM_CLASS; i++)
+	{
+		if (!(classes & BIT(i)))
+			continue;
+
+		WRITE_ONCE(data->last_updated[i], jiffies);
+		WRITE_ONCE(data->valid[i], true);
+	}
+
+	/* min/max are seeded from the first sample of each class */
+	WRITE_ONCE(data->sampled, data->sampled | classes);
+
+	if (hw_limits)
+		nct6687_notify_alarms(data, mon_alarms ^ data->shadow.mon_alarms, fan_alarms ^ data->shadow.fan_alarms);
+
+	if ((classes & NCT6687_UPDATE_TEMP) && data->curve_enabled)
+		nct6687_update_curves(data);
+}
+
+/*
+ * Sensor classes in the classes mask whose cached values have expired.
+ * In sampler mode only the classes the sampler did not produce yet.
+ */
+static unsigned int nct6687_stale_classes(struct nct6687_data *data, unsigned int classes)
+{
+	unsigned long interval = msecs_to_jiffies(READ_ONCE(data->update_interval));
+	unsigned int stale = 0;
+	int i;
+
+	if (sampler)
+		return classes & ~READ_ONCE(data->sampled);
+
+	for (i = 0; i < NCT6687_NUM_CLASS; i++)
+	{
+		if (!(classes & BIT(i)))
+			continue;
+
+		if (!READ_ONCE(data->valid[i]) || time_after(jiffies, READ_ONCE(data->last_updated[i]) + interval))
+			stale |= BIT(i);
+	}
+
+	return stale;
+}
+
+/*
+ * Refresh the sensor classes in the classes mask whose cached values are
+ * stale. With the coherent parameter set, every class is refreshed together.
+ * In sampler mode values are only refreshed by nct6687_sample_work(), except
+ * for a read racing the first sample after probe.
+ *
+ * Readers only take update_lock when a refresh is due; fresh values are
+ * read from the published copy under sample_lock.
+ */
+static struct nct6687_data *nct6687_update_device(struct device *dev, unsigned int classes)
+{
+	struct nct6687_data *data = dev_get_drvdata(dev);
+	u64 start = ktime_get_ns();
+	u64 locked;
+	unsigned int stale;
+
+	if (coherent)
+		classes = NCT6687_UPDATE_ALL;
+
+	if (!nct6687_stale_classes(data, classes))
+	{
+		atomic64_inc(&data->stats.cache_hits);
+		goto out;
+	}
+
+	mutex_lock(&data->update_lock);
+
+	locked = ktime_get_ns();
+	atomic64_inc(&data->stats.lock_waits);
+	atomic64_add(locked - start, &data->stats.lock_wait_ns);
+
+	/* Another reader may have refreshed while we waited for the lock */
+	stale = nct6687_stale_classes(data, classes);
+	if (stale)
+		nct6687_refresh(data, stale);
+	else
+		atomic64_inc(&data->stats.cache_hits);
+
+	mutex_unlock(&data->update_lock);
+
+out:
+	atomic64_inc(&data->stats.latency[min(fls64(div_u64(ktime_get_ns() - start, NSEC_PER_USEC)), NCT6687_LATENCY_BUCKETS - 1)]);
+
+	return data;
+}
+
+/* Copy all published sensor values at once */
+static void nct6687_read_sensors(struct nct6687_data *data, struct nct6687_sensors *sensors)
+{
+	unsigned int seq;
+
+	do
+	{
+		seq = read_seqbegin(&data->sample_lock);
+		*sensors = data->sensors;
+	} while (read_seqretry(&data->sample_lock, seq));
+}
+
+/*
+ * Wake up poll() and inotify waiters on the input attributes whose value
+ * moved by at least the per-class notify_* deadband since the last
+ * notification.
+ */
+static void nct6687_notify_changes(struct nct6687_data *data, const struct nct6687_sensors *sensors)
+{
+	struct kobject *kobj = &data->hwmon_dev->kobj;
+	bool seed = !data->notified_valid;
+	int in = READ_ONCE(notify_in);
+	int temp = READ_ONCE(notify_temp);
+	int fan = READ_ONCE(notify_fan);
+	char name[32];
+	int i;
+
+	for (i = 0; i < data->chip->num_voltage; i++)
+	{
+		if (!seed && (in <= 0 || abs(sensors->voltage[0][i] - data->notified_voltage[i]) < in))
+			continue;
+
+		data->notified_voltage[i] = sensors->voltage[0][i];
+		if (!seed)
+		{
+			snprintf(name, sizeof(name), "in%d_input", i);
+			sysfs_notify(kobj, NULL, name);
+		}
+	}
+
+	for (i = 0; i < data->chip->num_temp; i++)
+	{
+		if (!seed && (temp <= 0 || abs(sensors->temperature[0][i] - data->notified_temperature[i]) < temp))
+			continue;
+
+		data->notified_temperature[i] = sensors->temperature[0][i];
+		if (!seed)
+		{
+			snprintf(name, sizeof(name), "temp%d_input", i + 1);
+			sysfs_notify(kobj, NULL, name);
+		}
+	}
+
+	for (i = 0; i < data->chip->num_fan; i++)
+	{
+		if (!seed && (fan <= 0 || abs(sensors->rpm[0][i] - data->notified_rpm[i]) < fan))
+			continue;
+
+		data->notified_rpm[i] = sensors->rpm[0][i];
+		if (!seed)
+		{
+			snprintf(name, sizeof(name), "fan%d_input", i + 1);
+			sysfs_notify(kobj, NULL, name);
+		}
+	}
+
+	data->notified_valid = true;
+}
+
+/*
+ * Return the next adaptive sampling period. Changes are measured against a
+ * reference sample at least NCT6687_ADAPTIVE_WINDOW old, ignoring single LSB
+ * temperature flicker. A window where a temperature moves by at least
+ * adaptive_temp per second or a fan speed by at least adaptive_fan halves
+ * the period, two in a row select adaptive_floor. A stable window doubles
+ * the period, up to ceiling.
+ */
+static unsigned int nct6687_adapt_interval(struct nct6687_data *data, const struct nct6687_sensors *sensors, unsigned int ceiling)
+{
+	unsigned int floor = clamp_val(READ_ONCE(adaptive_floor), NCT6687_UPDATE_INTERVAL_MIN, ceiling);
+	int temp = READ_ONCE(adaptive_temp);
+	int fan = READ_ONCE(adaptive_fan);
+	bool active = false;
+	u64 elapsed_ms;
+	u64 delta;
+	int i;
+
+	if (data->activity_valid)
+	{
+		elapsed_ms = div_u64(sensors->updated_ns - data->activity_ns, NSEC_PER_MSEC);
+		if (elapsed_ms < NCT6687_ADAPTIVE_WINDOW)
+			return clamp_val(data->sample_interval, floor, ceiling);
+
+		for_each_set_bit(i, &data->have_temp, NCT6687_MAX_TEMP)
+		{
+			delta = abs(sensors->temperature[0][i] - data->activity_temperature[i]);
+			if (delta <= NCT6687_TEMP_LSB)
+				continue;
+			if (temp > 0 && div64_u64(delta * MSEC_PER_SEC, elapsed_ms) >= temp)
+				active = true;
+		}
+
+		for_each_set_bit(i, &data->have_fan, NCT6687_MAX_FAN)
+		{
+			if (fan > 0 && abs(sensors->rpm[0][i] - data->activity_rpm[i]) >= fan)
+				active = true;
+		}
+	}
+
+	memcpy(data->activity_temperature, sensors->temperature[0], sizeof(data->activity_temperature));
+	memcpy(data->activity_rpm, sensors->rpm[0], sizeof(data->activity_rpm));
+	data->activity_ns = sensors->updated_ns;
+	data->activity_valid = true;
+
+	if (active && data->activity_seen)
+		data->sample_interval = floor;
+	else if (active)
+		data->sample_interval = clamp_val(data->sample_interval / 2, floor, ceiling);
+	else
+		data->sample_interval = clamp_val(data->sample_interval * 2, floor, ceiling);
+	data->activity_seen = active;
+
+	return data->sample_interval;
+}
+
+static void nct6687_sample_work(struct work_struct *work)
+{
+	struct nct6687_data *data = container_of(to_delayed_work(work), struct nct6687_data, sample_work);
+	struct nct6687_sensors sensors;
+	unsigned int interval;
+	bool curves;
+
+	/*
+	 * Without the sampler, this only keeps fan curves evaluated and, with
+	 * hw_limits, the alarm status polled for *_alarm pollers.
+	 */
+	mutex_lock(&data->update_lock);
+	nct6687_refresh(data, sampler ? NCT6687_UPDATE_ALL : NCT6687_UPDATE_TEMP);
+	interval = data->update_interval;
+	curves = data->curve_enabled != 0;
+	mutex_unlock(&data->update_lock);
+
+	if (sampler)
+	{
+		nct6687_read_sensors(data, &sensors);
+		nct6687_notify_changes(data, &sensors);
+
+		if (adaptive)
+			interval = nct6687_adapt_interval(data, &sensors, interval);
+	}
+
+	if (sampler || hw_limits || curves)
+		queue_delayed_work(system_wq, &data->sample_work, msecs_to_jiffies(interval));
+}
+
+/* Read a published sensor value without taking update_lock */
+#define nct6687_sensor_value(data, field)                          \
+	({                                                             \
+		typeof((data)->sensors.field) __value;                     \
+		unsigned int __seq;                                        \
+		do                                                         \
+		{                                                          \
+			__seq = read_seqbegin(&(data)->sample_lock);           \
+			__value = (data)->sensors.field;                       \
+		} while (read_seqretry(&(data)->sample_lock, __seq));      \
+		__value;                                                   \
+	})
+
+/* Read a history statistic of a channel. The class must have been refreshed by the caller. */
+static int nct6687_read_history(struct nct6687_data *data, int class, int channel, int attr, long *val)
+{
+	int err;
+
+	mutex_lock(&data->update_lock);
+	err = nct6687_history_value(data, class, channel, attr, val);
+	mutex_unlock(&data->update_lock);
+
+	return err;
+}
+
+/* Drop the recorded samples and restart the lowest/highest values seen of the channels in mask */
+static void nct6687_reset_history(struct nct6687_data *data, int class, unsigned long mask)
+{
+	int i;
+
+	mutex_lock(&data->update_lock);
+
+	for_each_set_bit(i, &mask, NCT6687_HISTORY_CHANNELS)
+	{
+		data->history[class].count[i] = 0;
+
+		switch (class)
+		{
+		case NCT6687_CLASS_VOLTAGE:
+			data->shadow.voltage[1][i] = data->shadow.voltage[2][i] = data->shadow.voltage[0][i];
+			break;
+		case NCT6687_CLASS_TEMP:
+			data->shadow.temperature[1][i] = data->shadow.temperature[2][i] = data->shadow.temperature[0][i];
+			break;
+		default:
+			data->shadow.rpm[1][i] = data->shadow.rpm[2][i] = data->shadow.rpm[0][i];
+			break;
+		}
+	}
+
+	nct6687_publish(data);
+
+	mutex_unlock(&data->update_lock);
+}
+
+/*
+ * hwmon callback functions
+ */
+static int nct6687_voltage_read(struct device *dev, u32 attr, int channel, long *val)
+{
+	struct nct6687_data *data = nct6687_update_device(dev, NCT6687_UPDATE_VOLTAGE);
+
+	switch (attr)
+	{
+	case hwmon_in_input:
+		*val = nct6687_sensor_value(data, voltage[0][channel]);
+		return 0;
+	case hwmon_in_min:
+		if (hw_limits)
+			*val = nct6687_voltage_limit_from_reg(data, channel, data->in_low[channel]);
+		else
+			*val = nct6687_sensor_value(data, voltage[1][channel]);
+		return 0;
+	case hwmon_in_max:
+		if (hw_limits)
+			*val = nct6687_voltage_limit_from_reg(data, channel, data->in_high[channel]);
+		else
+			*val = nct6687_sensor_value(data, voltage[2][channel]);
+		return 0;
+	case hwmon_in_alarm:
+		*val = !!(nct6687_sensor_value(data, mon_alarms) & BIT(nct6687_voltage_mon_index(data, channel)));
+		return 0;
+	case hwmon_in_average:
+		return nct6687_read_history(data, NCT6687_CLASS_VOLTAGE, channel, history_attr_average, val);
+	case hwmon_in_lowest:
+		return nct6687_read_history(data, NCT6687_CLASS_VOLTAGE, channel, history_attr_lowest, val);
+	case hwmon_in_highest:
+		return nct6687_read_history(data, NCT6687_CLASS_VOLTAGE, channel, history_attr_highest, val);
+	default:
+		return -EOPNOTSUPP;
+	}
+}
+
+static int nct6687_voltage_write(struct device *dev, u32 attr, int channel, long val)
+{
+	struct nct6687_data *data = dev_get_drvdata(dev);
+	u8 reg_value;
+
+	if (attr == hwmon_in_reset_history)
+	{
+		nct6687_reset_history(data, NCT6687_CLASS_VOLTAGE, BIT(channel));
+		return 0;
+	}
+
+	if (!hw_limits || (attr != hwmon_in_min && attr != hwmon_in_max))
+		return -EOPNOTSUPP;
+
+	reg_value = nct6687_voltage_limit_to_reg(data, channel, val);
+
+	mutex_lock(&data->update_lock);
+
+	if (attr == hwmon_in_min)
+	{
+		data->in_low[channel] = reg_value;
+		nct6687_write(data, NCT6687_REG_MON_LOW(nct6687_voltage_mon_index(data, channel)), reg_value);
+	}
+	else
+	{
+		data->in_high[channel] = reg_value;
+		nct6687_write(data, NCT6687_REG_MON_HIGH(nct6687_voltage_mon_index(data, channel)), reg_value);
+	}
+
+	mutex_unlock(&data->update_lock);
+
+	return 0;
+}
+
+static int nct6687_fan_read(struct device *dev, u32 attr, int channel, long *val)
+{
+	struct nct6687_data *data = nct6687_update_device(dev, NCT6687_UPDATE_FAN);
+
+	switch (attr)
+	{
+	case hwmon_fan_input:
+		*val = nct6687_sensor_value(data, rpm[0][channel]);
+		return 0;
+	case hwmon_fan_min:
+		if (hw_limits)
+			*val = data->fan_min[channel];
+		else
+			*val = nct6687_sensor_value(data, rpm[1][channel]);
+		return 0;
+	case hwmon_fan_max:
+		*val = nct6687_sensor_value(data, rpm[2][channel]);
+		return 0;
+	case hwmon_fan_alarm:
+		*val = !!(nct6687_sensor_value(data, fan_alarms) & BIT(channel));
+		return 0;
+	default:
+		return -EOPNOTSUPP;
+	}
+}
+
+static int nct6687_fan_write(struct device *dev, u32 attr, int channel, long val)
+{
+	struct nct6687_data *data = dev_get_drvdata(dev);
+
+	if (!hw_limits || attr != hwmon_fan_min)
+		return -EOPNOTSUPP;
+
+	val = clamp_val(val, 0, 0xFFFF);
+
+	mutex_lock(&data->update_lock);
+	data->fan_min[channel] = val;
+	nct6687_write(data, NCT6687_REG_FAN_MIN(channel), (val >> 8) & 0xFF);
+	nct6687_write(data, NCT6687_REG_FAN_MIN(channel) + 1, val & 0xFF);
+	mutex_unlock(&data->update_lock);
+
+	return 0;
+}
+
+static int nct6687_temp_read(struct device *dev, u32 attr, int channel, long *val)
+{
+	struct nct6687_data *data = nct6687_update_device(dev, NCT6687_UPDATE_TEMP);
+
+	switch (attr)
+	{
+	case hwmon_temp_input:
+		*val = nct6687_sensor_value(data, temperature[0][channel]);
+		return 0;
+	case hwmon_temp_min:
+		*val = nct6687_sensor_value(data, temperature[1][channel]);
+		return 0;
+	case hwmon_temp_max:
+		if (hw_limits)
+			*val = (s8)data->temp_max[channel] * 1000;
+		else
+			*val = nct6687_sensor_value(data, temperature[2][channel]);
+		return 0;
+	case hwmon_temp_max_hyst:
+		*val = ((s8)data->temp_max[channel] - data->temp_hyst[channel]) * 1000;
+		return 0;
+	case hwmon_temp_alarm:
+		*val = !!(nct6687_sensor_value(data, mon_alarms) & BIT(channel));
+		return 0;
+	case hwmon_temp_lowest:
+		return nct6687_read_history(data, NCT6687_CLASS_TEMP, channel, history_attr_lowest, val);
+	case hwmon_temp_highest:
+		return nct6687_read_history(data, NCT6687_CLASS_TEMP, channel, history_attr_highest, val);
+	default:
+		return -EOPNOTSUPP;
+	}
+}
+
+static int nct6687_temp_write(struct device *dev, u32 attr, int channel, long val)
+{
+	struct nct6687_data *data = dev_get_drvdata(dev);
+
+	if (attr == hwmon_temp_reset_history)
+	{
+		nct6687_reset_history(data, NCT6687_CLASS_TEMP, BIT(channel));
+		return 0;
+	}
+
+	if (!hw_limits || (attr != hwmon_temp_max && attr != hwmon_temp_max_hyst))
+		return -EOPNOTSUPP;
+
+	val = clamp_val(DIV_ROUND_CLOSEST(val, 1000), -128, 127);
+
+	mutex_lock(&data->update_lock);
+
+	if (attr == hwmon_temp_max)
+	{
+		data->temp_max[channel] = (u8)val;
+		nct6687_write(data, NCT6687_REG_TEMP_MAX(channel), data->temp_max[channel]);
+	}
+	else
+	{
+		/* The EC stores the hysteresis relative to the limit */
+		data->temp_hyst[channel] = clamp_val((s8)data->temp_max[channel] - val, 0, 127);
+		nct6687_write(data, NCT6687_REG_TEMP_HYST(channel), data->temp_hyst[channel]);
+	}
+
+	mutex_unlock(&data->update_lock);
+
+	return 0;
+}
+
+/*
+ * Switch the channels in mask to manual mode and program their duty cycles
+ * within a single EC request/done handshake. The values read back from the
+ * EC are returned in readback. Caller must hold pwm_lock.
+ */
+static void nct6687_commit_pwm(struct nct6687_data *data, unsigned long mask, const u8 *val, u8 *readback)
+{
+	u64 start = trace_nct6687_pwm_commit_enabled() ? ktime_get_ns() : 0;
+	u8 pwm[NCT6687_NUM_REG_PWM];
+	unsigned long done = 0;
+	int retry, retries;
+	u16 mode;
+	int i;
+
+	for_each_set_bit(i, &mask, NCT6687_NUM_REG_PWM)
+		nct6687_save_fan_control(data, i);
+
+	mode = nct6687_read(data, NCT6687_REG_FAN_CTRL_MODE(0));
+	mode = (u8)(mode | mask);
+	nct6687_write(data, NCT6687_REG_FAN_CTRL_MODE(0), mode);
+	WRITE_ONCE(data->fan_ctrl_mode, mode);
+
+	nct6687_write(data, NCT6687_REG_FAN_PWM_COMMAND(0), NCT6687_FAN_CFG_REQ);
+	msleep(50);
+	for_each_set_bit(i, &mask, NCT6687_NUM_REG_PWM)
+		nct6687_write(data, NCT6687_REG_PWM_WRITE(i), val[i]);
+	nct6687_write(data, NCT6687_REG_FAN_PWM_COMMAND(0), NCT6687_FAN_CFG_DONE);
+
+	for (retry = 0; retry < NCT6687_PWM_READBACK_TRIES; retry++) {
+		msleep(50);
+
+		nct6687_read_block(data, NCT6687_REG_PWM(0), NCT6687_NUM_REG_PWM, pwm);
+
+		done = 0;
+		for_each_set_bit(i, &mask, NCT6687_NUM_REG_PWM)
+		{
+			readback[i] = pwm[i];
+			if (pwm[i] == val[i])
+				done |= BIT(i);
+		}
+
+		if (done == mask)
+			break;
+	}
+
+	/* The first read back is not a retry */
+	retries = min(retry, NCT6687_PWM_READBACK_TRIES - 1);
+
+	atomic64_inc(&data->stats.pwm_commits);
+	atomic64_add(retries, &data->stats.pwm_retries);
+	if (start)
+		trace_nct6687_pwm_commit(mask, done, retries, ktime_get_ns() - start);
+}
+
+/* Apply the PWM values queued by store_pwm() and store_pwm_all() */
+static void nct6687_pwm_work(struct work_struct *work)
+{
+	struct nct6687_data *data = container_of(work, struct nct6687_data, pwm_work);
+	u8 target[NCT6687_NUM_REG_PWM];
+	u8 readback[NCT6687_NUM_REG_PWM];
+	enum pwm_enable pwm_enable[NCT6687_NUM_REG_PWM];
+	unsigned long pending;
+	int i;
+
+	mutex_lock(&data->pwm_lock);
+
+	spin_lock(&data->pwm_pending_lock);
+	pending = data->pwm_pending;
+	memcpy(target, data->pwm_target, sizeof(target));
+	spin_unlock(&data->pwm_pending_lock);
+
+	if (!pending)
+		goto unlock;
+
+	nct6687_commit_pwm(data, pending, target, readback);
+
+	for_each_set_bit(i, &pending, NCT6687_NUM_REG_PWM)
+		pwm_enable[i] = nct6687_get_pwm_enable(data, i);
+
+	mutex_lock(&data->update_lock);
+	for_each_set_bit(i, &pending, NCT6687_NUM_REG_PWM)
+	{
+		data->shadow.pwm[i] = readback[i];
+		data->shadow.pwm_enable[i] = pwm_enable[i];
+	}
+	nct6687_publish(data);
+	mutex_unlock(&data->update_lock);
+
+	/* Keep channels pending if a new value was queued during the commit */
+	spin_lock(&data->pwm_pending_lock);
+	for_each_set_bit(i, &pending, NCT6687_NUM_REG_PWM)
+	{
+		if (data->pwm_target[i] == target[i])
+			clear_bit(i, &data->pwm_pending);
+	}
+	spin_unlock(&data->pwm_pending_lock);
+
+unlock:
+	mutex_unlock(&data->pwm_lock);
+}
+
+/* Queue PWM values for the channels in mask and kick nct6687_pwm_work() */
+static void nct6687_queue_pwm(struct nct6687_data *data, unsigned long mask, const u8 *val)
+{
+	int i;
+
+	spin_lock(&data->pwm_pending_lock);
+	for_each_set_bit(i, &mask, NCT6687_NUM_REG_PWM)
+	{
+		WRITE_ONCE(data->pwm_target[i], val[i]);
+		set_bit(i, &data->pwm_pending);
+	}
+	spin_unlock(&data->pwm_pending_lock);
+
+	schedule_work(&data->pwm_work);
+}
+
+/* Queue PWM values written by the user, taking the channels out of curve_mode */
+static void nct6687_queue_manual_pwm(struct nct6687_data *data, unsigned long mask, const u8 *val)
+{
+	mutex_lock(&data->update_lock);
+	data->curve_enabled &= ~mask;
+	nct6687_queue_pwm(data, mask, val);
+	mutex_unlock(&data->update_lock);
+}
+
+static ssize_t show_pwm_all(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct nct6687_data *data = nct6687_update_device(dev, NCT6687_UPDATE_PWM);
+	int len = 0;
+	int i;
+
+	for (i = 0; i < NCT6687_NUM_REG_PWM; i++)
+	{
+		u8 pwm = test_bit(i, &data->pwm_pending) ? READ_ONCE(data->pwm_target[i]) : nct6687_sensor_value(data, pwm[i]);
+
+		len += sprintf(buf + len, "%s%d", i ? " " : "", pwm);
+	}
+
+	return len + sprintf(buf + len, "\n");
+}
+
+/*
+ * Queue up to NCT6687_NUM_REG_PWM space separated values, one per channel,
+ * committed together in a single EC handshake. A "-" leaves that channel
+ * unchanged.
+ */
+static ssize_t store_pwm_all(struct device *dev, struct device_attribute *attr, const char *buf, size_t count)
+{
+	struct nct6687_data *data = dev_get_drvdata(dev);
+	u8 values[NCT6687_NUM_REG_PWM];
+	unsigned long mask = 0;
+	unsigned long val;
+	char *str, *p, *token;
+	int index = 0;
+	int err = 0;
+
+	str = kstrdup(buf, GFP_KERNEL);
+	if (!str)
+		return -ENOMEM;
+
+	p = str;
+	while ((token = strsep(&p, " \t\n")) != NULL)
+	{
+		if (*token == '\0')
+			continue;
+
+		if (index >= NCT6687_NUM_REG_PWM)
+		{
+			err = -EINVAL;
+			break;
+		}
+
+		if (strcmp(token, "-") != 0)
+		{
+			if (kstrtoul(token, 10, &val) || val > 255)
+			{
+				err = -EINVAL;
+				break;
+			}
+
+			values[index] = val;
+			mask |= BIT(index);
+		}
+
+		index++;
+	}
+
+	kfree(str);
+
+	if (err)
+		return err;
+	if (index == 0)
+		return -EINVAL;
+
+	if (mask)
+		nct6687_queue_manual_pwm(data, mask, values);
+
+	return count;
+}
+
+static int nct6687_pwm_read(struct device *dev, u32 attr, int channel, long *val)
+{
+	struct nct6687_data *data = nct6687_update_device(dev, NCT6687_UPDATE_PWM);
+
+	switch (attr)
+	{
+	case hwmon_pwm_input:
+		/* Report the requested value until the EC has confirmed it */
+		if (test_bit(channel, &data->pwm_pending))
+			*val = READ_ONCE(data->pwm_target[channel]);
+		else
+			*val = nct6687_sensor_value(data, pwm[channel]);
+		return 0;
+	case hwmon_pwm_enable:
+		if (test_bit(channel, &data->curve_enabled))
+			*val = curve_mode;
+		/* A queued PWM write switches the channel to manual mode */
+		else if (test_bit(channel, &data->pwm_pending))
+			*val = manual_mode;
+		else
+			*val = nct6687_sensor_value(data, pwm_enable[channel]);
+		return 0;
+	default:
+		return -EOPNOTSUPP;
+	}
+}
+
+static int nct6687_pwm_enable_write(struct nct6687_data *data, int index, long val)
+{
+	u16 mode;
 	u8 bitMask;
 
-	if (kstrtoul(buf, 10, &val) || val > 255 || index >= NCT6687_NUM_REG_FAN)
+	if (val != manual_mode && val != curve_mode && val != firmware_mode)
 		return -EINVAL;
 
+	/* Stop the curve first so that it cannot queue a value behind this write */
 	mutex_lock(&data->update_lock);
+	clear_bit(index, &data->curve_enabled);
+	mutex_unlock(&data->update_lock);
+
+	/* Apply queued PWM writes first so that they cannot override this mode */
+	flush_work(&data->pwm_work);
+
+	mutex_lock(&data->pwm_lock);
+
+	/* Drop a value queued since the flush, it would set the manual bit again */
+	spin_lock(&data->pwm_pending_lock);
+	clear_bit(index, &data->pwm_pending);
+	spin_unlock(&data->pwm_pending_lock);
 
 	nct6687_save_fan_control(data, index);
 
 	mode = nct6687_read(data, NCT6687_REG_FAN_CTRL_MODE(index));
+
 	bitMask = (u8)(0x01 << index);
+	if (val == manual_mode || val == curve_mode)
+	{
+		mode = (u8)(mode | bitMask);
+	}
+	else if (val == firmware_mode)
+	{
+		mode = (u8)(mode & ~bitMask);
+	}
 
-	mode = (u8)(mode | bitMask);
 	nct6687_write(data, NCT6687_REG_FAN_CTRL_MODE(index), mode);
+	WRITE_ONCE(data->fan_ctrl_mode, mode);
 
-	nct6687_write(data, NCT6687_REG_FAN_PWM_COMMAND(index), NCT6687_FAN_CFG_REQ);
-	msleep(50);
-	nct6687_write(data, NCT6687_REG_PWM_WRITE(index), val);
-	nct6687_write(data, NCT6687_REG_FAN_PWM_COMMAND(index), NCT6687_FAN_CFG_DONE);
+	mutex_lock(&data->update_lock);
+	data->shadow.pwm_enable[index] = nct6687_get_pwm_enable(data, index);
+	nct6687_publish(data);
 
-	for (retry = 0; retry < 20; retry++) {
-		msleep(50);
+	if (val == curve_mode)
+	{
+		data->curve[index].output_valid = false;
+		set_bit(index, &data->curve_enabled);
+	}
+	mutex_unlock(&data->update_lock);
 
-		readback = nct6687_read(data, NCT6687_REG_PWM(index));
-		if (readback == val)
-			break;
+	mutex_unlock(&data->pwm_lock);
+
+	/* Evaluate the curve right away, then at every update_interval */
+	if (val == curve_mode)
+		mod_delayed_work(system_wq, &data->sample_work, 0);
+
+	return 0;
+}
+
+/*
+ * The EC handshake takes at least 100 ms, so duty cycle writes are only
+ * queued here and committed by nct6687_pwm_work() without blocking sensor
+ * readers.
+ */
+static int nct6687_pwm_write(struct device *dev, u32 attr, int channel, long val)
+{
+	struct nct6687_data *data = dev_get_drvdata(dev);
+	u8 values[NCT6687_NUM_REG_PWM];
+
+	switch (attr)
+	{
+	case hwmon_pwm_input:
+		if (val < 0 || val > 255)
+			return -EINVAL;
+
+		values[channel] = val;
+		nct6687_queue_manual_pwm(data, BIT(channel), values);
+		return 0;
+	case hwmon_pwm_enable:
+		return nct6687_pwm_enable_write(data, channel, val);
+	default:
+		return -EOPNOTSUPP;
+	}
+}
+
+/* Fan curve attributes, index selects the curve point or setting */
+enum nct6687_curve_attr
+{
+	curve_attr_channels,
+	curve_attr_temp_sel,
+	curve_attr_hyst,
+	curve_attr_ramp_rate,
+};
+
+static ssize_t show_pwm_curve(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct sensor_device_attribute_2 *sattr = to_sensor_dev_attr_2(attr);
+	struct nct6687_data *data = dev_get_drvdata(dev);
+	struct nct6687_fan_curve *curve = &data->curve[sattr->nr];
+	int val;
+
+	mutex_lock(&data->update_lock);
+
+	switch (sattr->index)
+	{
+	case curve_attr_channels:
+		val = curve->temp_channels;
+		break;
+	case curve_attr_temp_sel:
+		val = ffs(curve->temp_channels);
+		break;
+	case curve_attr_hyst:
+		val = curve->hyst;
+		break;
+	default:
+		val = curve->ramp_rate;
+		break;
 	}
-	data->pwm[index] = readback;
-	data->pwm_enable[index] = nct6687_get_pwm_enable(data, index);
 
 	mutex_unlock(&data->update_lock);
 
+	return sprintf(buf, "%d\n", val);
+}
+
+static ssize_t store_pwm_curve(struct device *dev, struct device_attribute *attr, const char *buf, size_t count)
+{
+	struct sensor_device_attribute_2 *sattr = to_sensor_dev_attr_2(attr);
+	struct nct6687_data *data = dev_get_drvdata(dev);
+	struct nct6687_fan_curve *curve = &data->curve[sattr->nr];
+	unsigned long val;
+
+	if (kstrtoul(buf, 10, &val))
+		return -EINVAL;
+
+	if (sattr->index == curve_attr_channels && (val == 0 || (val & ~data->have_temp)))
+		return -EINVAL;
+
+	if (sattr->index == curve_attr_temp_sel && (val == 0 || val > NCT6687_MAX_TEMP || !test_bit(val - 1, &data->have_temp)))
+		return -EINVAL;
+
+	mutex_lock(&data->update_lock);
+
+	switch (sattr->index)
+	{
+	case curve_attr_channels:
+		curve->temp_channels = val;
+		break;
+	case curve_attr_temp_sel:
+		curve->temp_channels = BIT(val - 1);
+		break;
+	case curve_attr_hyst:
+		curve->hyst = clamp_val(val, 0, 50000);
+		break;
+	default:
+		curve->ramp_rate = clamp_val(val, 0, 255);
+		break;
+	}
+
+	mutex_unlock(&data->update_lock);
+
+	return count;
+}
+
+static ssize_t show_pwm_auto_point_temp(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct sensor_device_attribute_2 *sattr = to_sensor_dev_attr_2(attr);
+	struct nct6687_data *data = dev_get_drvdata(dev);
+	s32 val;
+
+	mutex_lock(&data->update_lock);
+	val = data->curve[sattr->nr].temp[sattr->index];
+	mutex_unlock(&data->update_lock);
+
+	return sprintf(buf, "%d\n", val);
+}
+
+static ssize_t store_pwm_auto_point_temp(struct device *dev, struct device_attribute *attr, const char *buf, size_t count)
+{
+	struct sensor_device_attribute_2 *sattr = to_sensor_dev_attr_2(attr);
+	struct nct6687_data *data = dev_get_drvdata(dev);
+	long val;
+
+	if (kstrtol(buf, 10, &val))
+		return -EINVAL;
+
+	mutex_lock(&data->update_lock);
+	data->curve[sattr->nr].temp[sattr->index] = clamp_val(val, -128000, 127000);
+	mutex_unlock(&data->update_lock);
+
 	return count;
 }
 
-static ssize_t show_pwm_enable(struct device *dev, struct device_attribute *attr, char *buf)
+static ssize_t show_pwm_auto_point_pwm(struct device *dev, struct device_attribute *attr, char *buf)
 {
-	struct nct6687_data *data = nct6687_update_device(dev);
 	struct sensor_device_attribute_2 *sattr = to_sensor_dev_attr_2(attr);
+	struct nct6687_data *data = dev_get_drvdata(dev);
+	u8 val;
+
+	mutex_lock(&data->update_lock);
+	val = data->curve[sattr->nr].pwm[sattr->index];
+	mutex_unlock(&data->update_lock);
 
-	return sprintf(buf, "%d\n", data->pwm_enable[sattr->nr]);
+	return sprintf(buf, "%d\n", val);
 }
 
-static ssize_t store_pwm_enable(struct device *dev, struct device_attribute *attr, const char *buf, size_t count)
+static ssize_t store_pwm_auto_point_pwm(struct device *dev, struct device_attribute *attr, const char *buf, size_t count)
 {
 	struct sensor_device_attribute_2 *sattr = to_sensor_dev_attr_2(attr);
 	struct nct6687_data *data = dev_get_drvdata(dev);
-	int index = sattr->nr;
 	unsigned long val;
-	u16 mode;
-	u8 bitMask;
 
-	if (index >= NCT6687_NUM_REG_FAN || kstrtoul(buf, 10, &val))
-		return -EINVAL;
-	if (val != manual_mode && val != firmware_mode)
-		return -EINVAL;
+	if (kstrtoul(buf, 10, &val) || val > 255)
+		return -EINVAL;
+
+	mutex_lock(&data->update_lock);
+	data->curve[sattr->nr].pwm[sattr->index] = val;
+	mutex_unlock(&data->update_lock);
+
+	return count;
+}
+
+/* Per channel fan curve attributes, nr is the channel */
+#define NCT6687_PWM_CURVE_ATTRS(_n)                                                                                                     \
+	static SENSOR_DEVICE_ATTR_2(pwm##_n##_auto_channels_temp, S_IRUGO | S_IWUSR, show_pwm_curve, store_pwm_curve, _n - 1, curve_attr_channels); \
+	static SENSOR_DEVICE_ATTR_2(pwm##_n##_temp_sel, S_IRUGO | S_IWUSR, show_pwm_curve, store_pwm_curve, _n - 1, curve_attr_temp_sel);           \
+	static SENSOR_DEVICE_ATTR_2(pwm##_n##_temp_tolerance, S_IRUGO | S_IWUSR, show_pwm_curve, store_pwm_curve, _n - 1, curve_attr_hyst);         \
+	static SENSOR_DEVICE_ATTR_2(pwm##_n##_ramp_rate, S_IRUGO | S_IWUSR, show_pwm_curve, store_pwm_curve, _n - 1, curve_attr_ramp_rate);        \
+	static SENSOR_DEVICE_ATTR_2(pwm##_n##_auto_point1_temp, S_IRUGO | S_IWUSR, show_pwm_auto_point_temp, store_pwm_auto_point_temp, _n - 1, 0); \
+	static SENSOR_DEVICE_ATTR_2(pwm##_n##_auto_point1_pwm, S_IRUGO | S_IWUSR, show_pwm_auto_point_pwm, store_pwm_auto_point_pwm, _n - 1, 0);    \
+	static SENSOR_DEVICE_ATTR_2(pwm##_n##_auto_point2_temp, S_IRUGO | S_IWUSR, show_pwm_auto_point_temp, store_pwm_auto_point_temp, _n - 1, 1); \
+	static SENSOR_DEVICE_ATTR_2(pwm##_n##_auto_point2_pwm, S_IRUGO | S_IWUSR, show_pwm_auto_point_pwm, store_pwm_auto_point_pwm, _n - 1, 1);    \
+	static SENSOR_DEVICE_ATTR_2(pwm##_n##_auto_point3_temp, S_IRUGO | S_IWUSR, show_pwm_auto_point_temp, store_pwm_auto_point_temp, _n - 1, 2); \
+	static SENSOR_DEVICE_ATTR_2(pwm##_n##_auto_point3_pwm, S_IRUGO | S_IWUSR, show_pwm_auto_point_pwm, store_pwm_auto_point_pwm, _n - 1, 2);    \
+	static SENSOR_DEVICE_ATTR_2(pwm##_n##_auto_point4_temp, S_IRUGO | S_IWUSR, show_pwm_auto_point_temp, store_pwm_auto_point_temp, _n - 1, 3); \
+	static SENSOR_DEVICE_ATTR_2(pwm##_n##_auto_point4_pwm, S_IRUGO | S_IWUSR, show_pwm_auto_point_pwm, store_pwm_auto_point_pwm, _n - 1, 3);    \
+	static SENSOR_DEVICE_ATTR_2(pwm##_n##_auto_point5_temp, S_IRUGO | S_IWUSR, show_pwm_auto_point_temp, store_pwm_auto_point_temp, _n - 1, 4); \
+	static SENSOR_DEVICE_ATTR_2(pwm##_n##_auto_point5_pwm, S_IRUGO | S_IWUSR, show_pwm_auto_point_pwm, store_pwm_auto_point_pwm, _n - 1, 4)
+
+#define NCT6687_PWM_CURVE_ATTR_LIST(_n)                         \
+	&sensor_dev_attr_pwm##_n##_auto_channels_temp.dev_attr.attr, \
+	&sensor_dev_attr_pwm##_n##_temp_sel.dev_attr.attr,           \
+	&sensor_dev_attr_pwm##_n##_temp_tolerance.dev_attr.attr,     \
+	&sensor_dev_attr_pwm##_n##_ramp_rate.dev_attr.attr,          \
+	&sensor_dev_attr_pwm##_n##_auto_point1_temp.dev_attr.attr,   \
+	&sensor_dev_attr_pwm##_n##_auto_point1_pwm.dev_attr.attr,    \
+	&sensor_dev_attr_pwm##_n##_auto_point2_temp.dev_attr.attr,   \
+	&sensor_dev_attr_pwm##_n##_auto_point2_pwm.dev_attr.attr,    \
+	&sensor_dev_attr_pwm##_n##_auto_point3_temp.dev_attr.attr,   \
+	&sensor_dev_attr_pwm##_n##_auto_point3_pwm.dev_attr.attr,    \
+	&sensor_dev_attr_pwm##_n##_auto_point4_temp.dev_attr.attr,   \
+	&sensor_dev_attr_pwm##_n##_auto_point4_pwm.dev_attr.attr,    \
+	&sensor_dev_attr_pwm##_n##_auto_point5_temp.dev_attr.attr,   \
+	&sensor_dev_attr_pwm##_n##_auto_point5_pwm.dev_attr.attr
+
+NCT6687_PWM_CURVE_ATTRS(1);
+NCT6687_PWM_CURVE_ATTRS(2);
+NCT6687_PWM_CURVE_ATTRS(3);
+NCT6687_PWM_CURVE_ATTRS(4);
+NCT6687_PWM_CURVE_ATTRS(5);
+NCT6687_PWM_CURVE_ATTRS(6);
+NCT6687_PWM_CURVE_ATTRS(7);
+NCT6687_PWM_CURVE_ATTRS(8);
+
+static struct attribute *nct6687_attributes_pwm_curve[] = {
+	NCT6687_PWM_CURVE_ATTR_LIST(1),
+	NCT6687_PWM_CURVE_ATTR_LIST(2),
+	NCT6687_PWM_CURVE_ATTR_LIST(3),
+	NCT6687_PWM_CURVE_ATTR_LIST(4),
+	NCT6687_PWM_CURVE_ATTR_LIST(5),
+	NCT6687_PWM_CURVE_ATTR_LIST(6),
+	NCT6687_PWM_CURVE_ATTR_LIST(7),
+	NCT6687_PWM_CURVE_ATTR_LIST(8),
+	NULL,
+};
+
+static const struct attribute_group nct6687_group_pwm_curve = {
+	.attrs = nct6687_attributes_pwm_curve,
+};
+
+static void nct6687_save_fan_control(struct nct6687_data *data, int index)
+{
+	if (data->_restoreDefaultFanControlRequired[index] == false)
+	{
+		u16 reg = nct6687_read(data, NCT6687_REG_FAN_CTRL_MODE(index));
+		u16 bitMask = 0x01 << index;
+		u8 pwm = nct6687_read(data, NCT6687_REG_FAN_PWM_COMMAND(index));
+
+		data->_initialFanControlMode[index] = (u8)(reg & bitMask);
+		data->_initialFanPwmCommand[index] = pwm;
+
+		data->_restoreDefaultFanControlRequired[index] = true;
+	}
+}
+
+static void nct6687_restore_fan_control(struct nct6687_data *data, int index)
+{
+	if (data->_restoreDefaultFanControlRequired[index])
+	{
+		u8 mode = nct6687_read(data, NCT6687_REG_FAN_CTRL_MODE(index));
+		u8 bitMask = 0x01 << index;
+		mode = (u8)((mode & ~bitMask) | data->_initialFanControlMode[index]);
+
+		nct6687_write(data, NCT6687_REG_FAN_CTRL_MODE(index), mode);
+
+		nct6687_write(data, NCT6687_REG_FAN_PWM_COMMAND(index), NCT6687_FAN_CFG_REQ);
+		msleep(50);
+		nct6687_write(data, NCT6687_REG_PWM_WRITE(index), data->_initialFanPwmCommand[index]);
+		nct6687_write(data, NCT6687_REG_FAN_PWM_COMMAND(index), NCT6687_FAN_CFG_DONE);
+		msleep(50);
+
+		data->_restoreDefaultFanControlRequired[index] = false;
+
+		pr_debug("nct6687_restore_fan_control[%d], addr=%04X, ctrl=%04X, _initialFanPwmCommand=%d\n", index, NCT6687_REG_FAN_PWM_COMMAND(index), NCT6687_REG_PWM_WRITE(index), data->_initialFanPwmCommand[index]);
+	}
+}
+
+static int nct6687_update_interval_write(struct nct6687_data *data, long val)
+{
+	val = clamp_val(val, NCT6687_UPDATE_INTERVAL_MIN, NCT6687_UPDATE_INTERVAL_MAX);
+
+	mutex_lock(&data->update_lock);
+	WRITE_ONCE(data->update_interval, val);
+	mutex_unlock(&data->update_lock);
+
+	/* Apply the new interval now rather than after the pending sample */
+	if (sampler || hw_limits || READ_ONCE(data->curve_enabled))
+		mod_delayed_work(system_wq, &data->sample_work, msecs_to_jiffies(val));
+
+	return 0;
+}
+
+static ssize_t show_sample_seq(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct nct6687_data *data = nct6687_update_device(dev, NCT6687_UPDATE_ALL);
+
+	return sprintf(buf, "%llu\n", nct6687_sensor_value(data, generation));
+}
+
+static ssize_t show_sample_time_ns(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct nct6687_data *data = nct6687_update_device(dev, NCT6687_UPDATE_ALL);
+
+	return sprintf(buf, "%llu\n", nct6687_sensor_value(data, updated_ns));
+}
+
+/* The bin_attribute read callback takes a const attribute since 6.13 */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 13, 0)
+static ssize_t read_snapshot(struct file *filp, struct kobject *kobj, const struct bin_attribute *attr, char *buf, loff_t off, size_t count)
+#else
+static ssize_t read_snapshot(struct file *filp, struct kobject *kobj, struct bin_attribute *attr, char *buf, loff_t off, size_t count)
+#endif
+{
+	struct nct6687_data *data = nct6687_update_device(kobj_to_dev(kobj), NCT6687_UPDATE_ALL);
+	struct nct6687_sensors sensors;
+	struct nct6687_snapshot snapshot;
+	int i, j;
+
+	BUILD_BUG_ON(NCT6687_MAX_VOLTAGE > NCT6687_SNAPSHOT_MAX_VOLTAGE);
+	BUILD_BUG_ON(NCT6687_MAX_TEMP > NCT6687_SNAPSHOT_MAX_TEMP);
+	BUILD_BUG_ON(NCT6687_MAX_FAN > NCT6687_SNAPSHOT_MAX_FAN);
+	BUILD_BUG_ON(NCT6687_NUM_REG_PWM > NCT6687_SNAPSHOT_MAX_PWM);
+
+	nct6687_read_sensors(data, &sensors);
+
+	memset(&snapshot, 0, sizeof(snapshot));
+	snapshot.version = NCT6687_SNAPSHOT_VERSION;
+	snapshot.size = sizeof(snapshot);
+	snapshot.generation = sensors.generation;
+	snapshot.jiffies = sensors.updated;
+	snapshot.num_voltage = data->chip->num_voltage;
+	snapshot.num_temp = data->chip->num_temp;
+	snapshot.num_fan = data->chip->num_fan;
+	snapshot.num_pwm = NCT6687_NUM_REG_PWM;
+	snapshot.pwm_pending = (u8)READ_ONCE(data->pwm_pending);
+
+	for (j = 0; j < 3; j++)
+	{
+		for (i = 0; i < data->chip->num_voltage; i++)
+			snapshot.voltage[j][i] = sensors.voltage[j][i];
+		for (i = 0; i < data->chip->num_temp; i++)
+			snapshot.temperature[j][i] = sensors.temperature[j][i];
+		for (i = 0; i < data->chip->num_fan; i++)
+			snapshot.rpm[j][i] = sensors.rpm[j][i];
+	}
+
+	for (i = 0; i < NCT6687_NUM_REG_PWM; i++)
+	{
+		snapshot.pwm[i] = sensors.pwm[i];
+		if (sensors.pwm_enable[i] == manual_mode)
+			snapshot.pwm_manual |= BIT(i);
+	}
+
+	return memory_read_from_buffer(buf, count, &off, &snapshot, sizeof(snapshot));
+}
+
+static DEVICE_ATTR(pwm_all, S_IRUGO | S_IWUSR, show_pwm_all, store_pwm_all);
+static DEVICE_ATTR(sample_seq, S_IRUGO, show_sample_seq, NULL);
+static DEVICE_ATTR(sample_time_ns, S_IRUGO, show_sample_time_ns, NULL);
+
+static struct attribute *nct6687_attributes_other[] = {
+	&dev_attr_pwm_all.attr,
+	&dev_attr_sample_seq.attr,
+	&dev_attr_sample_time_ns.attr,
+	NULL,
+};
+
+/* Binary attributes are const since 6.13, through the *_new members until 6.16 */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 13, 0)
+static const struct bin_attribute bin_attr_snapshot = {
+	.attr = {.name = "snapshot", .mode = S_IRUGO},
+	.size = sizeof(struct nct6687_snapshot),
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 16, 0)
+	.read_new = read_snapshot,
+#else
+	.read = read_snapshot,
+#endif
+};
+
+static const struct bin_attribute *const nct6687_bin_attributes_other[] = {
+	&bin_attr_snapshot,
+	NULL,
+};
+#else
+static struct bin_attribute bin_attr_snapshot = {
+	.attr = {.name = "snapshot", .mode = S_IRUGO},
+	.size = sizeof(struct nct6687_snapshot),
+	.read = read_snapshot,
+};
+
+static struct bin_attribute *nct6687_bin_attributes_other[] = {
+	&bin_attr_snapshot,
+	NULL,
+};
+#endif
+
+static const struct attribute_group nct6687_group_other = {
+	.attrs = nct6687_attributes_other,
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 13, 0) && LINUX_VERSION_CODE < KERNEL_VERSION(6, 16, 0)
+	.bin_attrs_new = nct6687_bin_attributes_other,
+#else
+	.bin_attrs = nct6687_bin_attributes_other,
+#endif
+};
+
+static ssize_t nct6687_show_history(struct device *dev, struct device_attribute *attr, char *buf, int class)
+{
+	struct sensor_device_attribute_2 *sattr = to_sensor_dev_attr_2(attr);
+	struct nct6687_data *data = nct6687_update_device(dev, BIT(class));
+	long val;
+	int err;
+
+	err = nct6687_read_history(data, class, sattr->nr, sattr->index, &val);
+	if (err)
+		return err;
+
+	return sprintf(buf, "%ld\n", val);
+}
+
+static ssize_t show_temp_history(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	return nct6687_show_history(dev, attr, buf, NCT6687_CLASS_TEMP);
+}
+
+static ssize_t show_fan_history(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	return nct6687_show_history(dev, attr, buf, NCT6687_CLASS_FAN);
+}
+
+static ssize_t store_fan_reset_history(struct device *dev, struct device_attribute *attr, const char *buf, size_t count)
+{
+	struct sensor_device_attribute_2 *sattr = to_sensor_dev_attr_2(attr);
+
+	nct6687_reset_history(dev_get_drvdata(dev), NCT6687_CLASS_FAN, BIT(sattr->nr));
 
-	mutex_lock(&data->update_lock);
+	return count;
+}
 
-	nct6687_save_fan_control(data, index);
+/* History attributes the hwmon core has no type for, nr is the channel */
+#define NCT6687_HISTORY_ATTRS(_n)                                                                                               \
+	static SENSOR_DEVICE_ATTR_2(temp##_n##_average, S_IRUGO, show_temp_history, NULL, _n - 1, history_attr_average);           \
+	static SENSOR_DEVICE_ATTR_2(fan##_n##_average, S_IRUGO, show_fan_history, NULL, _n - 1, history_attr_average);             \
+	static SENSOR_DEVICE_ATTR_2(fan##_n##_lowest, S_IRUGO, show_fan_history, NULL, _n - 1, history_attr_lowest);               \
+	static SENSOR_DEVICE_ATTR_2(fan##_n##_highest, S_IRUGO, show_fan_history, NULL, _n - 1, history_attr_highest);             \
+	static SENSOR_DEVICE_ATTR_2(fan##_n##_reset_history, S_IWUSR, NULL, store_fan_reset_history, _n - 1, 0)
 
-	mode = nct6687_read(data, NCT6687_REG_FAN_CTRL_MODE(index));
+/*
+ * nct6687_history_is_visible uses the index into the following list
+ * to determine if attributes should be created or not.
+ * Any change in order or content must be matched.
+ */
+#define NCT6687_HISTORY_ATTR_LIST(_n)                          \
+	&sensor_dev_attr_temp##_n##_average.dev_attr.attr,         \
+	&sensor_dev_attr_fan##_n##_average.dev_attr.attr,          \
+	&sensor_dev_attr_fan##_n##_lowest.dev_attr.attr,           \
+	&sensor_dev_attr_fan##_n##_highest.dev_attr.attr,          \
+	&sensor_dev_attr_fan##_n##_reset_history.dev_attr.attr
+
+#define NCT6687_HISTORY_ATTRS_PER_CHANNEL 5
+
+NCT6687_HISTORY_ATTRS(1);
+NCT6687_HISTORY_ATTRS(2);
+NCT6687_HISTORY_ATTRS(3);
+NCT6687_HISTORY_ATTRS(4);
+NCT6687_HISTORY_ATTRS(5);
+NCT6687_HISTORY_ATTRS(6);
+NCT6687_HISTORY_ATTRS(7);
+NCT6687_HISTORY_ATTRS(8);
+NCT6687_HISTORY_ATTRS(9);
+NCT6687_HISTORY_ATTRS(10);
+NCT6687_HISTORY_ATTRS(11);
+NCT6687_HISTORY_ATTRS(12);
+NCT6687_HISTORY_ATTRS(13);
+NCT6687_HISTORY_ATTRS(14);
+NCT6687_HISTORY_ATTRS(15);
+NCT6687_HISTORY_ATTRS(16);
+
+static struct attribute *nct6687_attributes_history[] = {
+	NCT6687_HISTORY_ATTR_LIST(1),
+	NCT6687_HISTORY_ATTR_LIST(2),
+	NCT6687_HISTORY_ATTR_LIST(3),
+	NCT6687_HISTORY_ATTR_LIST(4),
+	NCT6687_HISTORY_ATTR_LIST(5),
+	NCT6687_HISTORY_ATTR_LIST(6),
+	NCT6687_HISTORY_ATTR_LIST(7),
+	NCT6687_HISTORY_ATTR_LIST(8),
+	NCT6687_HISTORY_ATTR_LIST(9),
+	NCT6687_HISTORY_ATTR_LIST(10),
+	NCT6687_HISTORY_ATTR_LIST(11),
+	NCT6687_HISTORY_ATTR_LIST(12),
+	NCT6687_HISTORY_ATTR_LIST(13),
+	NCT6687_HISTORY_ATTR_LIST(14),
+	NCT6687_HISTORY_ATTR_LIST(15),
+	NCT6687_HISTORY_ATTR_LIST(16),
+	NULL,
+};
 
-	bitMask = (u8)(0x01 << index);
-	if (val == manual_mode)
-	{
-		mode = (u8)(mode | bitMask);
-	}
-	else if (val == firmware_mode)
-	{
-		mode = (u8)(mode & ~bitMask);
-	}
+static umode_t nct6687_history_is_visible(struct kobject *kobj, struct attribute *attr, int index)
+{
+	struct nct6687_data *data = dev_get_drvdata(kobj_to_dev(kobj));
+	int channel = index / NCT6687_HISTORY_ATTRS_PER_CHANNEL;
+	int nr = index % NCT6687_HISTORY_ATTRS_PER_CHANNEL;
 
-	nct6687_write(data, NCT6687_REG_FAN_CTRL_MODE(index), mode);
+	if (nr == 0) /* temp average */
+		return data->history_depth && test_bit(channel, &data->have_temp) ? attr->mode : 0;
 
-	mutex_unlock(&data->update_lock);
+	if (!test_bit(channel, &data->have_fan))
+		return 0;
 
-	return count;
+	if (nr == 4) /* reset_history */
+		return attr->mode;
+
+	return data->history_depth ? attr->mode : 0;
 }
 
-SENSOR_TEMPLATE(pwm, "pwm%d", S_IRUGO, show_pwm, store_pwm, 0);
-SENSOR_TEMPLATE_2(pwm_enable, "pwm%d_enable", S_IRUGO, show_pwm_enable, store_pwm_enable, 0, 0);
+static const struct attribute_group nct6687_group_history = {
+	.attrs = nct6687_attributes_history,
+	.is_visible = nct6687_history_is_visible,
+};
 
-static void nct6687_save_fan_control(struct nct6687_data *data, int index)
-{
-	if (data->_restoreDefaultFanControlRequired[index] == false)
-	{
-		u16 reg = nct6687_read(data, NCT6687_REG_FAN_CTRL_MODE(index));
-		u16 bitMask = 0x01 << index;
-		u8 pwm = nct6687_read(data, NCT6687_REG_FAN_PWM_COMMAND(index));
+static const struct attribute_group *nct6687_groups[] = {
+	&nct6687_group_pwm_curve,
+	&nct6687_group_history,
+	&nct6687_group_other,
+	NULL,
+};
 
-		data->_initialFanControlMode[index] = (u8)(reg & bitMask);
-		data->_initialFanPwmCommand[index] = pwm;
+static umode_t nct6687_is_visible(const void *drvdata, enum hwmon_sensor_types type, u32 attr, int channel)
+{
+	const struct nct6687_data *data = drvdata;
 
-		data->_restoreDefaultFanControlRequired[index] = true;
+	switch (type)
+	{
+	case hwmon_chip:
+		if (attr == hwmon_chip_in_reset_history || attr == hwmon_chip_temp_reset_history)
+			return S_IWUSR;
+		return attr == hwmon_chip_update_interval ? S_IRUGO | S_IWUSR : 0;
+	case hwmon_in:
+		if (!test_bit(channel, &data->have_in))
+			return 0;
+		if (attr == hwmon_in_reset_history)
+			return S_IWUSR;
+		if (attr == hwmon_in_average || attr == hwmon_in_lowest || attr == hwmon_in_highest)
+			return data->history_depth ? S_IRUGO : 0;
+		if (attr == hwmon_in_alarm)
+			return hw_limits ? S_IRUGO : 0;
+		if (attr == hwmon_in_min || attr == hwmon_in_max)
+			return hw_limits ? S_IRUGO | S_IWUSR : S_IRUGO;
+		return S_IRUGO;
+	case hwmon_fan:
+		if (!test_bit(channel, &data->have_fan))
+			return 0;
+		if (attr == hwmon_fan_min)
+			return hw_limits ? S_IRUGO | S_IWUSR : S_IRUGO;
+		if (attr == hwmon_fan_max)
+			return hw_limits ? 0 : S_IRUGO;
+		if (attr == hwmon_fan_alarm)
+			return hw_limits ? S_IRUGO : 0;
+		return S_IRUGO;
+	case hwmon_temp:
+		if (!test_bit(channel, &data->have_temp))
+			return 0;
+		if (attr == hwmon_temp_reset_history)
+			return S_IWUSR;
+		if (attr == hwmon_temp_lowest || attr == hwmon_temp_highest)
+			return data->history_depth ? S_IRUGO : 0;
+		if (attr == hwmon_temp_min)
+			return hw_limits ? 0 : S_IRUGO;
+		if (attr == hwmon_temp_max)
+			return hw_limits ? S_IRUGO | S_IWUSR : S_IRUGO;
+		if (attr == hwmon_temp_max_hyst)
+			return hw_limits ? S_IRUGO | S_IWUSR : 0;
+		if (attr == hwmon_temp_alarm)
+			return hw_limits ? S_IRUGO : 0;
+		return S_IRUGO;
+	case hwmon_pwm:
+		return S_IRUGO | S_IWUSR;
+	default:
+		return 0;
 	}
 }
 
-static void nct6687_restore_fan_control(struct nct6687_data *data, int index)
+static int nct6687_hwmon_read(struct device *dev, enum hwmon_sensor_types type, u32 attr, int channel, long *val)
 {
-	if (data->_restoreDefaultFanControlRequired[index])
-	{
-		u8 mode = nct6687_read(data, NCT6687_REG_FAN_CTRL_MODE(index));
-		u8 bitMask = 0x01 << index;
-		mode = (u8)((mode & ~bitMask) | data->_initialFanControlMode[index]);
-
-		nct6687_write(data, NCT6687_REG_FAN_CTRL_MODE(index), mode);
+	struct nct6687_data *data = dev_get_drvdata(dev);
 
-		nct6687_write(data, NCT6687_REG_FAN_PWM_COMMAND(index), NCT6687_FAN_CFG_REQ);
-		msleep(50);
-		nct6687_write(data, NCT6687_REG_PWM_WRITE(index), data->_initialFanPwmCommand[index]);
-		nct6687_write(data, NCT6687_REG_FAN_PWM_COMMAND(index), NCT6687_FAN_CFG_DONE);
-		msleep(50);
+	switch (type)
+	{
+	case hwmon_chip:
+		if (attr != hwmon_chip_update_interval)
+			return -EOPNOTSUPP;
+		*val = READ_ONCE(data->update_interval);
+		return 0;
+	case hwmon_in:
+		return nct6687_voltage_read(dev, attr, channel, val);
+	case hwmon_fan:
+		return nct6687_fan_read(dev, attr, channel, val);
+	case hwmon_temp:
+		return nct6687_temp_read(dev, attr, channel, val);
+	case hwmon_pwm:
+		return nct6687_pwm_read(dev, attr, channel, val);
+	default:
+		return -EOPNOTSUPP;
+	}
+}
 
-		data->_restoreDefaultFanControlRequired[index] = false;
+static int nct6687_hwmon_read_string(struct device *dev, enum hwmon_sensor_types type, u32 attr, int channel, const char **str)
+{
+	struct nct6687_data *data = dev_get_drvdata(dev);
 
-		pr_debug("nct6687_restore_fan_control[%d], addr=%04X, ctrl=%04X, _initialFanPwmCommand=%d\n", index, NCT6687_REG_FAN_PWM_COMMAND(index), NCT6687_REG_PWM_WRITE(index), data->_initialFanPwmCommand[index]);
+	switch (type)
+	{
+	case hwmon_in:
+		*str = manual ? nct6687_manual_voltage_label[channel] : data->chip->voltage[channel].label;
+		return 0;
+	case hwmon_fan:
+		*str = data->chip->fan_label[channel];
+		return 0;
+	case hwmon_temp:
+		*str = data->chip->temp_label[channel];
+		return 0;
+	default:
+		return -EOPNOTSUPP;
 	}
 }
 
-static umode_t nct6687_pwm_is_visible(struct kobject *kobj, struct attribute *attr, int index)
+static int nct6687_hwmon_write(struct device *dev, enum hwmon_sensor_types type, u32 attr, int channel, long val)
 {
-	return attr->mode | S_IWUSR;
+	struct nct6687_data *data = dev_get_drvdata(dev);
+
+	switch (type)
+	{
+	case hwmon_chip:
+		if (attr == hwmon_chip_in_reset_history)
+		{
+			nct6687_reset_history(data, NCT6687_CLASS_VOLTAGE, data->have_in);
+			return 0;
+		}
+		if (attr == hwmon_chip_temp_reset_history)
+		{
+			nct6687_reset_history(data, NCT6687_CLASS_TEMP, data->have_temp);
+			return 0;
+		}
+		if (attr != hwmon_chip_update_interval)
+			return -EOPNOTSUPP;
+		return nct6687_update_interval_write(data, val);
+	case hwmon_in:
+		return nct6687_voltage_write(dev, attr, channel, val);
+	case hwmon_fan:
+		return nct6687_fan_write(dev, attr, channel, val);
+	case hwmon_temp:
+		return nct6687_temp_write(dev, attr, channel, val);
+	case hwmon_pwm:
+		return nct6687_pwm_write(dev, attr, channel, val);
+	default:
+		return -EOPNOTSUPP;
+	}
 }
 
-static struct sensor_device_template *nct6687_attributes_pwm_template[] = {
-	&sensor_dev_template_pwm,
-	&sensor_dev_template_pwm_enable,
+#define NCT6687_IN_CONFIG (HWMON_I_INPUT | HWMON_I_LABEL | HWMON_I_MIN | HWMON_I_MAX | HWMON_I_ALARM | \
+						   HWMON_I_AVERAGE | HWMON_I_LOWEST | HWMON_I_HIGHEST | HWMON_I_RESET_HISTORY)
+#define NCT6687_FAN_CONFIG (HWMON_F_INPUT | HWMON_F_LABEL | HWMON_F_MIN | HWMON_F_MAX | HWMON_F_ALARM)
+#define NCT6687_TEMP_CONFIG (HWMON_T_INPUT | HWMON_T_LABEL | HWMON_T_MIN | HWMON_T_MAX | HWMON_T_MAX_HYST | HWMON_T_ALARM | \
+							 HWMON_T_LOWEST | HWMON_T_HIGHEST | HWMON_T_RESET_HISTORY)
+#define NCT6687_PWM_CONFIG (HWMON_PWM_INPUT | HWMON_PWM_ENABLE)
+
+/*
+ * Channels are declared up to the NCT6687_MAX_* sensor window limits,
+ * nct6687_is_visible() hides the ones the chip kind or masks leave out.
+ */
+static const struct hwmon_channel_info *const nct6687_info[] = {
+	HWMON_CHANNEL_INFO(chip, HWMON_C_UPDATE_INTERVAL | HWMON_C_IN_RESET_HISTORY | HWMON_C_TEMP_RESET_HISTORY),
+	HWMON_CHANNEL_INFO(in,
+					   NCT6687_IN_CONFIG, NCT6687_IN_CONFIG, NCT6687_IN_CONFIG, NCT6687_IN_CONFIG,
+					   NCT6687_IN_CONFIG, NCT6687_IN_CONFIG, NCT6687_IN_CONFIG, NCT6687_IN_CONFIG,
+					   NCT6687_IN_CONFIG, NCT6687_IN_CONFIG, NCT6687_IN_CONFIG, NCT6687_IN_CONFIG,
+					   NCT6687_IN_CONFIG, NCT6687_IN_CONFIG, NCT6687_IN_CONFIG, NCT6687_IN_CONFIG),
+	HWMON_CHANNEL_INFO(fan,
+					   NCT6687_FAN_CONFIG, NCT6687_FAN_CONFIG, NCT6687_FAN_CONFIG, NCT6687_FAN_CONFIG,
+					   NCT6687_FAN_CONFIG, NCT6687_FAN_CONFIG, NCT6687_FAN_CONFIG, NCT6687_FAN_CONFIG,
+					   NCT6687_FAN_CONFIG, NCT6687_FAN_CONFIG, NCT6687_FAN_CONFIG, NCT6687_FAN_CONFIG,
+					   NCT6687_FAN_CONFIG, NCT6687_FAN_CONFIG, NCT6687_FAN_CONFIG, NCT6687_FAN_CONFIG),
+	HWMON_CHANNEL_INFO(temp,
+					   NCT6687_TEMP_CONFIG, NCT6687_TEMP_CONFIG, NCT6687_TEMP_CONFIG, NCT6687_TEMP_CONFIG,
+					   NCT6687_TEMP_CONFIG, NCT6687_TEMP_CONFIG, NCT6687_TEMP_CONFIG, NCT6687_TEMP_CONFIG,
+					   NCT6687_TEMP_CONFIG, NCT6687_TEMP_CONFIG, NCT6687_TEMP_CONFIG, NCT6687_TEMP_CONFIG,
+					   NCT6687_TEMP_CONFIG, NCT6687_TEMP_CONFIG, NCT6687_TEMP_CONFIG, NCT6687_TEMP_CONFIG),
+	HWMON_CHANNEL_INFO(pwm,
+					   NCT6687_PWM_CONFIG, NCT6687_PWM_CONFIG, NCT6687_PWM_CONFIG, NCT6687_PWM_CONFIG,
+					   NCT6687_PWM_CONFIG, NCT6687_PWM_CONFIG, NCT6687_PWM_CONFIG, NCT6687_PWM_CONFIG),
 	NULL,
 };
 
-static const struct sensor_template_group nct6687_pwm_template_group = {
-	.templates = nct6687_attributes_pwm_template,
-	.is_visible = nct6687_pwm_is_visible,
-	.base = 1,
+static const struct hwmon_ops nct6687_hwmon_ops = {
+	.is_visible = nct6687_is_visible,
+	.read = nct6687_hwmon_read,
+	.read_string = nct6687_hwmon_read_string,
+	.write = nct6687_hwmon_write,
+};
+
+static const struct hwmon_chip_info nct6687_hwmon_chip_info = {
+	.ops = &nct6687_hwmon_ops,
+	.info = nct6687_info,
 };
 
 /* Get the monitoring functions started */
@@ -957,102 +3068,295 @@ static inline void nct6687_init_device(struct nct6687_data *data)
 	nct6687_write(data, 0x1BF, 0x65);
 }
 
+/*
+ * Verify that the EC keeps up with the requested port access delay by
+ * comparing a few firmware registers, read on different pages, against
+ * values read with paused port I/O. Fall back to paused I/O on mismatch.
+ */
+static void nct6687_check_io_delay(struct device *dev, struct nct6687_data *data)
+{
+	u8 version_hi, version_lo, hwm_cfg;
+	int delay = data->io_delay;
+	int i;
+
+	if (delay == NCT6687_IO_DELAY_PAUSED)
+		return;
+
+	/* Compare actual EC reads, not cached values */
+	regcache_cache_bypass(data->regmap, true);
+
+	data->io_delay = NCT6687_IO_DELAY_PAUSED;
+	version_hi = nct6687_read(data, NCT6687_REG_VERSION_HI);
+	version_lo = nct6687_read(data, NCT6687_REG_VERSION_LO);
+	hwm_cfg = nct6687_read(data, NCT6687_HWM_CFG);
+	data->io_delay = delay;
+
+	for (i = 0; i < NCT6687_IO_CHECK_LOOPS; i++)
+	{
+		if (nct6687_read(data, NCT6687_REG_VERSION_HI) != version_hi ||
+			nct6687_read(data, NCT6687_REG_VERSION_LO) != version_lo ||
+			nct6687_read(data, NCT6687_HWM_CFG) != hwm_cfg)
+		{
+			dev_warn(dev, "EC unstable with io_delay=%d, using paused port I/O\n", delay);
+			data->io_delay = NCT6687_IO_DELAY_PAUSED;
+			nct6687_invalidate_page(data);
+			regcache_cache_bypass(data->regmap, false);
+
+			/* Values cached so far were read with the unstable delay */
+			regcache_drop_region(data->regmap, 0, nct6687_regmap_config.max_register);
+			return;
+		}
+	}
+
+	regcache_cache_bypass(data->regmap, false);
+
+	pr_debug("nct6687_check_io_delay: io_delay=%d\n", delay);
+}
+
 /*
  * There are a total of 8 fan inputs.
+ * Sensor values are read by the first refresh, only fan control state is saved here.
  */
 static void nct6687_setup_fans(struct nct6687_data *data)
 {
+	u8 mode = READ_ONCE(data->fan_ctrl_mode);
 	int i;
 
-	for (i = 0; i < NCT6687_NUM_REG_FAN; i++)
+	/* The initial control state is saved before the first change of each channel */
+	for (i = 0; i < NCT6687_NUM_REG_PWM; i++)
 	{
-		u16 reg = nct6687_read(data, NCT6687_REG_FAN_CTRL_MODE(i));
-		u16 bitMask = 0x01 << i;
-		u16 rpm = nct6687_read16(data, NCT6687_REG_FAN_RPM(i));
-
-		data->rpm[0][i] = rpm;
-		data->rpm[1][i] = rpm;
-		data->rpm[2][i] = rpm;
-		data->_initialFanControlMode[i] = (u8)(reg & bitMask);
 		data->_restoreDefaultFanControlRequired[i] = false;
 
-		pr_debug("nct6687_setup_fans[%d], %s - addr=%04X, ctrl=%04X, rpm=%d, _initialFanControlMode=%d\n", i, nct6687_fan_label[i], NCT6687_REG_FAN_CTRL_MODE(i), reg, rpm, data->_initialFanControlMode[i]);
+		pr_debug("nct6687_setup_fans[%d], %s - addr=%04X, ctrl=%04X\n", i, data->chip->fan_label[i], NCT6687_REG_FAN_CTRL_MODE(i), mode);
 	}
 }
 
-static void nct6687_setup_voltages(struct nct6687_data *data)
+/*
+ * Monitored channels. With fan_autodetect, fans reading 0 RPM while the
+ * firmware controls them are considered unconnected.
+ */
+static void nct6687_setup_channels(struct device *dev, struct nct6687_data *data)
 {
-	int index;
-	char buf[64];
+	u8 rpm[NCT6687_MAX_FAN * 2];
+	int i;
 
-	/* Measured voltages and limits */
-	for (index = 0; index < NCT6687_NUM_REG_VOLTAGE; index++)
+	data->have_fan = fan_mask & GENMASK(data->chip->num_fan - 1, 0);
+	data->have_in = in_mask & GENMASK(data->chip->num_voltage - 1, 0);
+	data->have_temp = temp_mask & GENMASK(data->chip->num_temp - 1, 0);
+
+	if (!fan_autodetect)
+		return;
+
+	nct6687_read_block(data, NCT6687_REG_FAN_RPM(0), data->chip->num_fan * 2, rpm);
+
+	for (i = 0; i < data->chip->num_fan; i++)
 	{
-		s16 reg = manual ? index : nct6687_voltage_definition[index].reg;
-		s16 high = nct6687_read(data, NCT6687_REG_VOLTAGE(reg)) * 16;
-		s16 low = ((u16)nct6687_read(data, NCT6687_REG_VOLTAGE(reg) + 1)) >> 4;
-		s16 value = low + high;
-		s16 voltage = manual ? value : value * nct6687_voltage_definition[index].multiplier;
+		if (rpm[i * 2] || rpm[i * 2 + 1] || (i < NCT6687_NUM_REG_PWM && nct6687_get_pwm_enable(data, i) != firmware_mode))
+			continue;
+
+		if (test_and_clear_bit(i, &data->have_fan))
+			dev_info(dev, "%s not spinning, hiding fan%d\n", data->chip->fan_label[i], i + 1);
+	}
+}
+
+/* Default curve: follow the CPU temperature from 30% at 30 C to full speed at 70 C */
+static void nct6687_setup_curve(struct nct6687_fan_curve *curve)
+{
+	static const s32 temp[NCT6687_CURVE_POINTS] = {30000, 40000, 50000, 60000, 70000};
+	static const u8 pwm[NCT6687_CURVE_POINTS] = {77, 102, 140, 191, 255};
+
+	curve->temp_channels = BIT(0);
+	memcpy(curve->temp, temp, sizeof(curve->temp));
+	memcpy(curve->pwm, pwm, sizeof(curve->pwm));
+	curve->hyst = 2000;
+	curve->ramp_rate = 0;
+}
+
+static void nct6687_setup_pwm(struct nct6687_data *data)
+{
+	int i;
+
+	nct6687_update_fan_ctrl_mode(data);
 
-		data->voltage[0][index] = voltage;
-		data->voltage[1][index] = voltage;
-		data->voltage[2][index] = voltage;
+	for (i = 0; i < NCT6687_NUM_REG_PWM; i++)
+	{
+		nct6687_setup_curve(&data->curve[i]);
 
-		pr_debug("nct6687_setup_voltages[%d], %s, addr=0x%04x, value=%d, voltage=%d\n", index, nct6687_voltage_label(buf, index), NCT6687_REG_VOLTAGE(index), value, voltage);
+		pr_debug("nct6687_setup_pwm[%d], pwm_enable=%d\n", i, nct6687_get_pwm_enable(data, i));
 	}
 }
 
-static void nct6687_setup_temperatures(struct nct6687_data *data)
+static void nct6687_setup_limits(struct nct6687_data *data)
 {
 	int i;
 
-	for (i = 0; i < NCT6687_NUM_REG_TEMP; i++)
+	for (i = 0; i < data->chip->num_voltage; i++)
+	{
+		data->in_low[i] = nct6687_read(data, NCT6687_REG_MON_LOW(nct6687_voltage_mon_index(data, i)));
+		data->in_high[i] = nct6687_read(data, NCT6687_REG_MON_HIGH(nct6687_voltage_mon_index(data, i)));
+	}
+
+	for (i = 0; i < data->chip->num_temp; i++)
 	{
-		s32 value = (char)nct6687_read(data, NCT6687_REG_TEMP(i));
-		s32 half = (nct6687_read(data, NCT6687_REG_TEMP(i) + 1) >> 7) & 0x1;
-		s32 temperature = (value * 1000) + (5 * half);
+		data->temp_max[i] = nct6687_read(data, NCT6687_REG_TEMP_MAX(i));
+		data->temp_hyst[i] = nct6687_read(data, NCT6687_REG_TEMP_HYST(i));
+	}
+
+	for (i = 0; i < data->chip->num_fan; i++)
+		data->fan_min[i] = nct6687_read16(data, NCT6687_REG_FAN_MIN(i));
+}
+
+static int nct6687_get_max_state(struct thermal_cooling_device *tcdev, unsigned long *state)
+{
+	*state = 255;
+
+	return 0;
+}
+
+static int nct6687_get_cur_state(struct thermal_cooling_device *tcdev, unsigned long *state)
+{
+	struct nct6687_cooling *cooling = tcdev->devdata;
+	long val;
+	int err;
+
+	err = nct6687_pwm_read(cooling->data->hwmon_dev, hwmon_pwm_input, cooling->channel, &val);
+	if (err)
+		return err;
+
+	*state = val;
+
+	return 0;
+}
+
+/* Same path as a pwmN write: queued, switches the channel to manual mode */
+static int nct6687_set_cur_state(struct thermal_cooling_device *tcdev, unsigned long state)
+{
+	struct nct6687_cooling *cooling = tcdev->devdata;
+	u8 values[NCT6687_NUM_REG_PWM];
+
+	if (state > 255)
+		return -EINVAL;
+
+	values[cooling->channel] = state;
+	nct6687_queue_manual_pwm(cooling->data, BIT(cooling->channel), values);
 
-		data->temperature[0][i] = temperature;
-		data->temperature[1][i] = temperature;
-		data->temperature[2][i] = temperature;
+	return 0;
+}
+
+static const struct thermal_cooling_device_ops nct6687_cooling_ops = {
+	.get_max_state = nct6687_get_max_state,
+	.get_cur_state = nct6687_get_cur_state,
+	.set_cur_state = nct6687_set_cur_state,
+};
+
+static void nct6687_unregister_cooling(struct nct6687_data *data)
+{
+	int i;
+
+	for (i = 0; i < NCT6687_NUM_REG_PWM; i++)
+	{
+		if (data->cooling[i].tcdev)
+			thermal_cooling_device_unregister(data->cooling[i].tcdev);
 
-		pr_debug("nct6687_setup_temperatures[%d]], addr=%04X, value=%d, half=%d, temperature=%d\n", i, NCT6687_REG_TEMP(i), value, half, temperature);
+		data->cooling[i].tcdev = NULL;
 	}
 }
 
-static void nct6687_setup_pwm(struct nct6687_data *data)
+/*
+ * Failures are not fatal, the channel stays available through sysfs. No
+ * zone binds these devices by itself, see cooling_device in the README.
+ */
+static void nct6687_register_cooling(struct device *dev, struct nct6687_data *data)
 {
+	struct nct6687_cooling *cooling;
+	struct thermal_cooling_device *tcdev;
 	int i;
 
 	for (i = 0; i < NCT6687_NUM_REG_PWM; i++)
 	{
-		data->_initialFanPwmCommand[i] = nct6687_read(data, NCT6687_REG_FAN_PWM_COMMAND(i));
-		data->pwm[i] = nct6687_read(data, NCT6687_REG_PWM(i));
-		data->pwm_enable[i] = nct6687_get_pwm_enable(data, i);
+		cooling = &data->cooling[i];
+		cooling->data = data;
+		cooling->channel = i;
+		snprintf(cooling->type, sizeof(cooling->type), "%s-pwm%d", nct6687_device_names[data->kind], i + 1);
+
+		tcdev = thermal_cooling_device_register(cooling->type, cooling, &nct6687_cooling_ops);
+		if (IS_ERR(tcdev))
+		{
+			dev_warn(dev, "failed to register cooling device %s: %ld\n", cooling->type, PTR_ERR(tcdev));
+			continue;
+		}
 
-		pr_debug("nct6687_setup_pwm[%d], addr=%04X, pwm=%d, pwm_enable=%d, _initialFanPwmCommand=%d\n",
-		         i,
-		         NCT6687_REG_FAN_PWM_COMMAND(i),
-		         data->pwm[i],
-		         data->pwm_enable[i],
-		         data->_initialFanPwmCommand[i]);
+		cooling->tcdev = tcdev;
 	}
 }
 
-static int nct6687_remove(struct platform_device *pdev)
+static int nct6687_stats_show(struct seq_file *s, void *unused)
 {
-	struct device *dev = &pdev->dev;
-	struct nct6687_data *data = dev_get_drvdata(dev);
+	struct nct6687_data *data = s->private;
+	struct nct6687_stats *stats = &data->stats;
 	int i;
 
-	mutex_lock(&data->update_lock);
+	seq_printf(s, "ec_reads: %lld\n", atomic64_read(&stats->ec_reads));
+	seq_printf(s, "ec_writes: %lld\n", atomic64_read(&stats->ec_writes));
+	seq_printf(s, "page_switches: %lld\n", atomic64_read(&stats->page_switches));
+	seq_printf(s, "refreshes: %lld\n", atomic64_read(&stats->refreshes));
+	seq_printf(s, "cache_hits: %lld\n", atomic64_read(&stats->cache_hits));
+	seq_printf(s, "refresh_ns: %lld\n", atomic64_read(&stats->refresh_ns));
+	seq_printf(s, "refresh_max_ns: %llu\n", READ_ONCE(stats->refresh_max_ns));
+	seq_printf(s, "lock_waits: %lld\n", atomic64_read(&stats->lock_waits));
+	seq_printf(s, "lock_wait_ns: %lld\n", atomic64_read(&stats->lock_wait_ns));
+	seq_printf(s, "pwm_commits: %lld\n", atomic64_read(&stats->pwm_commits));
+	seq_printf(s, "pwm_retries: %lld\n", atomic64_read(&stats->pwm_retries));
+
+	if (sampler && adaptive)
+		seq_printf(s, "sample_interval_ms: %u\n", READ_ONCE(data->sample_interval));
+
+	seq_puts(s, "update_latency_us:\n");
+	for (i = 0; i < NCT6687_LATENCY_BUCKETS - 1; i++)
+		seq_printf(s, "  < %u: %lld\n", 1U << i, atomic64_read(&stats->latency[i]));
+	seq_printf(s, "  >= %u: %lld\n", 1U << (i - 1), atomic64_read(&stats->latency[i]));
+
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(nct6687_stats);
+
+static void nct6687_init_debugfs(struct device *dev, struct nct6687_data *data)
+{
+	data->debugfs = debugfs_create_dir(dev_name(dev), NULL);
+	debugfs_create_file("stats", 0400, data->debugfs, data, &nct6687_stats_fops);
+}
+
+/*
+ * devres action registered before the hwmon device, so it only runs once the
+ * sysfs attributes that queue sample_work and pwm_work are gone.
+ */
+static void nct6687_release_fan_control(void *arg)
+{
+	struct nct6687_data *data = arg;
+	int i;
 
-	for (i = 0; i < NCT6687_NUM_REG_FAN; i++)
+	/* sample_work queues pwm_work for fan curves, stop it first */
+	cancel_delayed_work_sync(&data->sample_work);
+	cancel_work_sync(&data->pwm_work);
+
+	mutex_lock(&data->pwm_lock);
+
+	for (i = 0; i < NCT6687_NUM_REG_PWM; i++)
 	{
 		nct6687_restore_fan_control(data, i);
 	}
 
-	mutex_unlock(&data->update_lock);
+	mutex_unlock(&data->pwm_lock);
+}
+
+static int nct6687_remove(struct platform_device *pdev)
+{
+	struct device *dev = &pdev->dev;
+	struct nct6687_data *data = dev_get_drvdata(dev);
+
+	/* Stop governors from queueing PWM writes, works are cancelled by nct6687_release_fan_control() */
+	nct6687_unregister_cooling(data);
+	debugfs_remove_recursive(data->debugfs);
 
 	return 0;
 }
@@ -1061,132 +3365,186 @@ static int nct6687_probe(struct platform_device *pdev)
 {
 	struct device *dev = &pdev->dev;
 	struct nct6687_sio_data *sio_data = dev->platform_data;
-	struct attribute_group *group;
 	struct nct6687_data *data;
 	struct device *hwmon_dev;
+	struct regmap_config regmap_config;
 	struct resource *res;
-	int groups = 0;
 	char build[16];
-
-	res = platform_get_resource(pdev, IORESOURCE_IO, 0);
-	if (!devm_request_region(dev, res->start, IOREGION_LENGTH, DRVNAME))
-		return -EBUSY;
+	int err;
 
 	data = devm_kzalloc(dev, sizeof(struct nct6687_data), GFP_KERNEL);
 	if (!data)
 		return -ENOMEM;
 
+	if (sim)
+	{
+		err = nct6687_sim_init(dev, data);
+		if (err)
+			return err;
+
+		data->ec_ops = &nct6687_sim_ops;
+	}
+	else
+	{
+		res = platform_get_resource(pdev, IORESOURCE_IO, 0);
+		if (!devm_request_region(dev, res->start, IOREGION_LENGTH, DRVNAME))
+			return -EBUSY;
+
+		data->addr = res->start;
+		data->ec_ops = &nct6687_port_ops;
+	}
+
 	data->kind = sio_data->kind;
+	data->chip = &nct6687_chip_info[data->kind];
 	data->sioreg = sio_data->sioreg;
-	data->addr = res->start;
+	data->ec_page = -1;
+	data->io_delay = clamp_val(io_delay, NCT6687_IO_DELAY_PAUSED, NCT6687_IO_DELAY_MAX);
+	data->update_interval = NCT6687_UPDATE_INTERVAL_DEFAULT;
 
-	pr_debug("nct6687_probe addr=0x%04X, sioreg=0x%04X\n", data->addr, data->sioreg);
+	pr_debug("nct6687_probe addr=0x%04X, sioreg=0x%04X, backend=%s\n", data->addr, data->sioreg, data->ec_ops->name);
 
 	mutex_init(&data->update_lock);
 	mutex_init(&data->EC_io_lock);
+	mutex_init(&data->pwm_lock);
+	spin_lock_init(&data->pwm_pending_lock);
+	seqlock_init(&data->sample_lock);
+	INIT_DELAYED_WORK(&data->sample_work, nct6687_sample_work);
+	INIT_WORK(&data->pwm_work, nct6687_pwm_work);
 	platform_set_drvdata(pdev, data);
 
-	nct6687_init_device(data);
-	nct6687_setup_fans(data);
-	nct6687_setup_pwm(data);
-	nct6687_setup_temperatures(data);
-	nct6687_setup_voltages(data);
-
-	/* Register sysfs hooks */
-
-	group = nct6687_create_attr_group(dev, &nct6687_pwm_template_group, NCT6687_NUM_REG_FAN);
+	regmap_config = nct6687_regmap_config;
+	regmap_config.lock_arg = data;
 
-	if (IS_ERR(group))
-		return PTR_ERR(group);
+	data->regmap = devm_regmap_init(dev, NULL, data, &regmap_config);
+	if (IS_ERR(data->regmap))
+		return PTR_ERR(data->regmap);
 
-	data->groups[groups++] = group;
-
-	group = nct6687_create_attr_group(dev, &nct6687_voltage_template_group, NCT6687_NUM_REG_VOLTAGE);
+	err = nct6687_allocate_history(dev, data);
+	if (err)
+		return err;
 
-	if (IS_ERR(group))
-		return PTR_ERR(group);
+	err = devm_add_action_or_reset(dev, nct6687_release_fan_control, data);
+	if (err)
+		return err;
 
-	data->groups[groups++] = group;
+	nct6687_init_device(data);
+	nct6687_check_io_delay(dev, data);
+	nct6687_setup_pwm(data);
+	nct6687_setup_fans(data);
+	nct6687_setup_channels(dev, data);
 
-	group = nct6687_create_attr_group(dev, &nct6687_fan_template_group, NCT6687_NUM_REG_FAN);
+	if (hw_limits)
+		nct6687_setup_limits(data);
 
-	if (IS_ERR(group))
-		return PTR_ERR(group);
+	scnprintf(build, sizeof(build), "%02d/%02d/%02d", nct6687_read(data, NCT6687_REG_BUILD_MONTH), nct6687_read(data, NCT6687_REG_BUILD_DAY), nct6687_read(data, NCT6687_REG_BUILD_YEAR));
 
-	data->groups[groups++] = group;
+	dev_info(dev, "%s EC firmware version %d.%d build %s\n", nct6687_chip_names[data->kind], nct6687_read(data, NCT6687_REG_VERSION_HI), nct6687_read(data, NCT6687_REG_VERSION_LO), build);
 
-	group = nct6687_create_attr_group(dev, &nct6687_temp_template_group, NCT6687_NUM_REG_TEMP);
+	hwmon_dev = devm_hwmon_device_register_with_info(dev, nct6687_device_names[data->kind], data, &nct6687_hwmon_chip_info, nct6687_groups);
 
-	if (IS_ERR(group))
-		return PTR_ERR(group);
+	if (IS_ERR(hwmon_dev))
+		return PTR_ERR(hwmon_dev);
 
-	data->groups[groups++] = group;
+	data->hwmon_dev = hwmon_dev;
 
-	scnprintf(build, sizeof(build), "%02d/%02d/%02d", nct6687_read(data, NCT6687_REG_BUILD_MONTH), nct6687_read(data, NCT6687_REG_BUILD_DAY), nct6687_read(data, NCT6687_REG_BUILD_YEAR));
+	nct6687_init_debugfs(dev, data);
 
-	dev_info(dev, "%s EC firmware version %d.%d build %s\n", nct6687_chip_names[data->kind], nct6687_read(data, NCT6687_REG_VERSION_HI), nct6687_read(data, NCT6687_REG_VERSION_LO), build);
+	if (cooling_device)
+		nct6687_register_cooling(dev, data);
 
-	hwmon_dev = devm_hwmon_device_register_with_groups(dev, nct6687_device_names[data->kind], data, data->groups);
+	if (sampler || hw_limits)
+		queue_delayed_work(system_wq, &data->sample_work, 0);
 
-	return PTR_ERR_OR_ZERO(hwmon_dev);
+	return 0;
 }
 
-static int nct6687_suspend(struct platform_device *pdev, pm_message_t state)
+static int __maybe_unused nct6687_suspend(struct device *dev)
 {
-	struct nct6687_data *data = nct6687_update_device(&pdev->dev);
+	struct nct6687_data *data = dev_get_drvdata(dev);
 
-	mutex_lock(&data->update_lock);
-	data->hwm_cfg = nct6687_read(data, NCT6687_HWM_CFG);
-	mutex_unlock(&data->update_lock);
+	cancel_delayed_work_sync(&data->sample_work);
+	flush_work(&data->pwm_work);
+
+	/* Save the channels under driver control and their duty cycles */
+	mutex_lock(&data->pwm_lock);
+	data->pm_ctrl_mode = nct6687_read(data, NCT6687_REG_FAN_CTRL_MODE(0));
+	if (data->pm_ctrl_mode)
+		nct6687_read_block(data, NCT6687_REG_PWM(0), NCT6687_NUM_REG_PWM, data->pm_pwm);
+	mutex_unlock(&data->pwm_lock);
+
+	/* HWM_CFG stays in the register cache and is written back on resume */
+	regcache_mark_dirty(data->regmap);
 
 	return 0;
 }
 
-static int nct6687_resume(struct platform_device *pdev)
+static int __maybe_unused nct6687_resume(struct device *dev)
 {
-	struct device *dev = &pdev->dev;
 	struct nct6687_data *data = dev_get_drvdata(dev);
+	u8 mode;
+	int i;
 
+	/* Firmware may have used the EC while we were suspended */
+	nct6687_invalidate_page(data);
+	nct6687_check_io_delay(dev, data);
+
+	mutex_lock(&data->pwm_lock);
 	mutex_lock(&data->update_lock);
 
-	nct6687_write(data, NCT6687_HWM_CFG, data->hwm_cfg);
+	/* Re-read the control mode set by the firmware, then hand back the channels it should not own */
+	regcache_drop_region(data->regmap, NCT6687_REG_FAN_CTRL_MODE(0), NCT6687_REG_FAN_CTRL_MODE(0));
+	regcache_sync(data->regmap);
+
+	mode = nct6687_read(data, NCT6687_REG_FAN_CTRL_MODE(0));
+	if (mode & ~data->pm_ctrl_mode)
+		nct6687_write(data, NCT6687_REG_FAN_CTRL_MODE(0), mode & data->pm_ctrl_mode);
+	nct6687_update_fan_ctrl_mode(data);
 
 	/* Force re-reading all values */
-	data->valid = false;
+	memset(data->valid, 0, sizeof(data->valid));
+
+	for_each_set_bit(i, &data->curve_enabled, NCT6687_NUM_REG_PWM)
+		data->curve[i].output_valid = false;
+
+	/*
+	 * Reapply the manual duty cycles in a single handshake from
+	 * nct6687_pwm_work(), so that resume does not wait for the EC.
+	 */
+	if (data->pm_ctrl_mode)
+		nct6687_queue_pwm(data, data->pm_ctrl_mode, data->pm_pwm);
+
 	mutex_unlock(&data->update_lock);
+	mutex_unlock(&data->pwm_lock);
+
+	if (sampler || hw_limits || READ_ONCE(data->curve_enabled))
+		queue_delayed_work(system_wq, &data->sample_work, 0);
 
 	return 0;
 }
 
-// static const struct dev_pm_ops nct6687_dev_pm_ops = {
-// 	.suspend = nct6687_suspend,
-// 	.resume = nct6687_resume,
-// 	.freeze = nct6687_suspend,
-// 	.restore = nct6687_resume,
-// };
-
-#define NCT6687_DEV_PM_OPS NULL
+static SIMPLE_DEV_PM_OPS(nct6687_dev_pm_ops, nct6687_suspend, nct6687_resume);
 
 #pragma GCC diagnostic push
 #pragma GCC diagnostic ignored "-Wincompatible-pointer-types"
 static struct platform_driver nct6687_driver = {
 	.driver = {
 		.name = DRVNAME,
-		.pm = NCT6687_DEV_PM_OPS,
+		.pm = &nct6687_dev_pm_ops,
+		.probe_type = PROBE_PREFER_ASYNCHRONOUS,
 	},
 	.probe = nct6687_probe,
 	.remove = nct6687_remove,
-	.suspend = nct6687_suspend,
-	.resume = nct6687_resume,
 };
 #pragma GCC diagnostic pop
 
 static int __init nct6687_find(int sioaddr, struct nct6687_sio_data *sio_data)
 {
+	unsigned int delay = SIO_ADDR_VERIFY_DELAY_US;
 	u16 address;
 	u16 verify;
 	u16 val;
 	int err;
+	int i;
 
 	err = superio_enter(sioaddr);
 	if (err)
@@ -1219,9 +3577,18 @@ static int __init nct6687_find(int sioaddr, struct nct6687_sio_data *sio_data)
 
 	/* We have a known chip, find the HWM I/O address */
 	superio_select(sioaddr, NCT6687_LD_HWM);
-	address = (superio_inb(sioaddr, SIO_REG_ADDR) << 8) | superio_inb(sioaddr, SIO_REG_ADDR + 1);
-	ssleep(1);
-	verify = (superio_inb(sioaddr, SIO_REG_ADDR) << 8) | superio_inb(sioaddr, SIO_REG_ADDR + 1);
+	address = superio_inw(sioaddr, SIO_REG_ADDR);
+	verify = superio_inw(sioaddr, SIO_REG_ADDR);
+
+	/* The address may still be settling after the logical device switch */
+	for (i = 1; i < SIO_ADDR_VERIFY_TRIES && address != verify; i++)
+	{
+		usleep_range(delay, delay * 2);
+		delay *= 4;
+
+		address = verify;
+		verify = superio_inw(sioaddr, SIO_REG_ADDR);
+	}
 
 	if (address == 0 || address != verify)
 	{
@@ -1265,6 +3632,32 @@ fail:
  */
 static struct platform_device *pdev[2];
 
+/* Register a single simulated nct6687, without touching the Super-I/O ports */
+static int __init nct6687_sim_register(void)
+{
+	struct nct6687_sio_data sio_data = {
+		.sioreg = 0,
+		.kind = nct6687,
+	};
+	int err;
+
+	pdev[0] = platform_device_alloc(DRVNAME, 0);
+	if (!pdev[0])
+		return -ENOMEM;
+
+	err = platform_device_add_data(pdev[0], &sio_data, sizeof(struct nct6687_sio_data));
+	if (!err)
+		err = platform_device_add(pdev[0]);
+
+	if (err)
+	{
+		platform_device_put(pdev[0]);
+		pdev[0] = NULL;
+	}
+
+	return err;
+}
+
 static int __init sensors_nct6687_init(void)
 {
 	struct nct6687_sio_data sio_data;
@@ -1278,6 +3671,15 @@ static int __init sensors_nct6687_init(void)
 	if (err)
 		return err;
 
+	if (sim)
+	{
+		err = nct6687_sim_register();
+		if (err)
+			goto exit_unregister;
+
+		return 0;
+	}
+
 	/*
 	 * initialize sio_data->kind and sio_data->sioreg.
 	 *
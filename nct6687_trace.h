@@ -0,0 +1,139 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*
+ * nct6687 - Tracepoints for the EC access path
+ *
+ * Durations are only measured while the matching event is enabled.
+ */
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM nct6687
+
+#if !defined(_NCT6687_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _NCT6687_TRACE_H
+
+#include <linux/tracepoint.h>
+
+DECLARE_EVENT_CLASS(nct6687_ec_access,
+
+	TP_PROTO(u16 reg, u8 value, u64 duration_ns),
+
+	TP_ARGS(reg, value, duration_ns),
+
+	TP_STRUCT__entry(
+		__field(u16, reg)
+		__field(u8, value)
+		__field(u64, duration_ns)
+	),
+
+	TP_fast_assign(
+		__entry->reg = reg;
+		__entry->value = value;
+		__entry->duration_ns = duration_ns;
+	),
+
+	TP_printk("reg=0x%04x value=0x%02x duration_ns=%llu",
+		  __entry->reg, __entry->value, __entry->duration_ns)
+);
+
+DEFINE_EVENT(nct6687_ec_access, nct6687_ec_read,
+	TP_PROTO(u16 reg, u8 value, u64 duration_ns),
+	TP_ARGS(reg, value, duration_ns)
+);
+
+DEFINE_EVENT(nct6687_ec_access, nct6687_ec_write,
+	TP_PROTO(u16 reg, u8 value, u64 duration_ns),
+	TP_ARGS(reg, value, duration_ns)
+);
+
+TRACE_EVENT(nct6687_ec_read_block,
+
+	TP_PROTO(u16 reg, u16 len, u64 duration_ns),
+
+	TP_ARGS(reg, len, duration_ns),
+
+	TP_STRUCT__entry(
+		__field(u16, reg)
+		__field(u16, len)
+		__field(u64, duration_ns)
+	),
+
+	TP_fast_assign(
+		__entry->reg = reg;
+		__entry->len = len;
+		__entry->duration_ns = duration_ns;
+	),
+
+	TP_printk("reg=0x%04x len=%u duration_ns=%llu",
+		  __entry->reg, __entry->len, __entry->duration_ns)
+);
+
+TRACE_EVENT(nct6687_refresh_start,
+
+	TP_PROTO(unsigned int classes),
+
+	TP_ARGS(classes),
+
+	TP_STRUCT__entry(
+		__field(unsigned int, classes)
+	),
+
+	TP_fast_assign(
+		__entry->classes = classes;
+	),
+
+	TP_printk("classes=0x%x", __entry->classes)
+);
+
+TRACE_EVENT(nct6687_refresh_end,
+
+	TP_PROTO(unsigned int classes, u64 generation, u64 duration_ns),
+
+	TP_ARGS(classes, generation, duration_ns),
+
+	TP_STRUCT__entry(
+		__field(unsigned int, classes)
+		__field(u64, generation)
+		__field(u64, duration_ns)
+	),
+
+	TP_fast_assign(
+		__entry->classes = classes;
+		__entry->generation = generation;
+		__entry->duration_ns = duration_ns;
+	),
+
+	TP_printk("classes=0x%x generation=%llu duration_ns=%llu",
+		  __entry->classes, __entry->generation, __entry->duration_ns)
+);
+
+TRACE_EVENT(nct6687_pwm_commit,
+
+	TP_PROTO(unsigned long mask, unsigned long done, int retries, u64 duration_ns),
+
+	TP_ARGS(mask, done, retries, duration_ns),
+
+	TP_STRUCT__entry(
+		__field(unsigned long, mask)
+		__field(unsigned long, done)
+		__field(int, retries)
+		__field(u64, duration_ns)
+	),
+
+	TP_fast_assign(
+		__entry->mask = mask;
+		__entry->done = done;
+		__entry->retries = retries;
+		__entry->duration_ns = duration_ns;
+	),
+
+	TP_printk("mask=0x%02lx done=0x%02lx retries=%d duration_ns=%llu",
+		  __entry->mask, __entry->done, __entry->retries, __entry->duration_ns)
+);
+
+#endif /* _NCT6687_TRACE_H */
+
+/* This part must be outside protection */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE nct6687_trace
+#include <trace/define_trace.h>